@@ -28,9 +28,15 @@
 #include <linux/tty.h>
 #include <asm/atomic.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
 #include <linux/cred.h> /* current_uid(), current_euid() */
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
+#include <linux/timekeeping.h> /* ktime_get_ns() */
+#include <linux/uaccess.h>     /* copy_to_user() */
 
 #include "scull.h"        /* local definitions */
 
@@ -63,13 +69,14 @@ static int scull_s_open(struct inode *inode, struct file *filp)
 
 	/* then, everything else is copied from the bare scull device */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+		scull_open_trim(dev);
 	filp->private_data = dev;
 	return 0;          /* success */
 }
 
 static int scull_s_release(struct inode *inode, struct file *filp)
 {
+	scull_fasync(-1, filp, 0);
 	atomic_inc(&scull_s_available); /* release the device */
 	return 0;
 }
@@ -84,6 +91,8 @@ struct file_operations scull_sngl_fops = {
 	.read =       	scull_read,
 	.write =      	scull_write,
 	.unlocked_ioctl = scull_ioctl,
+	.poll =       	scull_poll,
+	.fasync =     	scull_fasync,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
 };
@@ -100,10 +109,29 @@ static int scull_u_count;	/* initialized to 0 by default */
 static uid_t scull_u_owner;	/* initialized to 0 by default */
 static DEFINE_SPINLOCK(scull_u_lock);
 
+/*
+ * With scull_u_private set, nobody waits: each uid gets a device of
+ * its own instead, kept with the scullpriv clones (see below).
+ */
+static bool scull_u_private;
+module_param(scull_u_private, bool, 0644);
+
+#define SCULL_C_TTY 0	/* the kinds of clones */
+#define SCULL_C_UID 1
+static struct scull_dev *scull_c_lookfor_device(int kind, unsigned int key);
+static int scull_c_release(struct inode *inode, struct file *filp);
+
 static int scull_u_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev = &scull_u_device; /* device information */
 
+	if (READ_ONCE(scull_u_private)) {
+		dev = scull_c_lookfor_device(SCULL_C_UID, current_uid().val);
+		if (!dev)
+			return -ENOMEM;
+		goto out;
+	}
+
 	spin_lock(&scull_u_lock);
 	if (scull_u_count && 
 	                (scull_u_owner != current_uid().val) &&  /* allow user */
@@ -119,16 +147,22 @@ static int scull_u_open(struct inode *inode, struct file *filp)
 	scull_u_count++;
 	spin_unlock(&scull_u_lock);
 
+  out:
 /* then, everything else is copied from the bare scull device */
 
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+		scull_open_trim(dev);
 	filp->private_data = dev;
 	return 0;          /* success */
 }
 
 static int scull_u_release(struct inode *inode, struct file *filp)
 {
+	if (filp->private_data != &scull_u_device) /* a private one */
+		return scull_c_release(inode, filp);
+
+	scull_fasync(-1, filp, 0);
+
 	spin_lock(&scull_u_lock);
 	scull_u_count--; /* nothing else */
 	spin_unlock(&scull_u_lock);
@@ -146,6 +180,8 @@ struct file_operations scull_user_fops = {
 	.read =       scull_read,
 	.write =      scull_write,
 	.unlocked_ioctl = scull_ioctl,
+	.poll =       scull_poll,
+	.fasync =     scull_fasync,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
 };
@@ -159,9 +195,25 @@ struct file_operations scull_user_fops = {
 static struct scull_dev scull_w_device;
 static int scull_w_count;	/* initialized to 0 by default */
 static uid_t scull_w_owner;	/* initialized to 0 by default */
-static DECLARE_WAIT_QUEUE_HEAD(scull_w_wait);
 static DEFINE_SPINLOCK(scull_w_lock);
 
+/*
+ * Openers that have to wait queue up in order, and the last release
+ * hands the device straight to the first of them (and to any other
+ * waiter with the same uid), waking only those: nobody else needs to
+ * look, and nobody can slip in ahead of the queue, as the device is
+ * never free while anyone is waiting.
+ */
+struct scull_w_waiter {
+	struct list_head list;
+	struct task_struct *task;
+	uid_t uid;
+	int granted;
+};
+
+static LIST_HEAD(scull_w_queue);
+static struct scull_w_stats scull_w_stats;
+
 static inline int scull_w_available(void)
 {
 	return scull_w_count == 0 ||
@@ -170,42 +222,106 @@ static inline int scull_w_available(void)
 		capable(CAP_DAC_OVERRIDE);
 }
 
+/* With the lock held: give the device to the next uid in line */
+static void scull_w_handoff(void)
+{
+	struct scull_w_waiter *w, *next;
+
+	if (list_empty(&scull_w_queue))
+		return;
+	scull_w_owner = list_first_entry(&scull_w_queue,
+			struct scull_w_waiter, list)->uid;
+	scull_w_stats.handoffs++;
+	list_for_each_entry_safe(w, next, &scull_w_queue, list) {
+		if (w->uid != scull_w_owner)
+			continue;
+		list_del(&w->list);
+		scull_w_stats.depth--;
+		scull_w_count++;
+		WRITE_ONCE(w->granted, 1);
+		wake_up_process(w->task);
+	}
+}
 
 static int scull_w_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev = &scull_w_device; /* device information */
+	struct scull_w_waiter w;
+	u64 start, waited;
+
+	spin_lock(&scull_w_lock);
+	if (scull_w_available()) {
+		if (scull_w_count == 0)
+			scull_w_owner = current_uid().val; /* grab it */
+		scull_w_count++;
+		spin_unlock(&scull_w_lock);
+		goto out;
+	}
+	if (filp->f_flags & O_NONBLOCK) {
+		spin_unlock(&scull_w_lock);
+		return -EAGAIN;
+	}
+
+	/* get in line, and wait to be handed the device */
+	w.task = current;
+	w.uid = current_uid().val;
+	w.granted = 0;
+	list_add_tail(&w.list, &scull_w_queue);
+	if (++scull_w_stats.depth > scull_w_stats.depth_peak)
+		scull_w_stats.depth_peak = scull_w_stats.depth;
+	spin_unlock(&scull_w_lock);
+
+	start = ktime_get_ns();
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (READ_ONCE(w.granted) || signal_pending(current))
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	waited = ktime_get_ns() - start;
 
 	spin_lock(&scull_w_lock);
-	while (! scull_w_available()) {
+	if (!w.granted) { /* a signal, and nobody let us in meanwhile */
+		list_del(&w.list);
+		scull_w_stats.depth--;
 		spin_unlock(&scull_w_lock);
-		if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
-		if (wait_event_interruptible (scull_w_wait, scull_w_available()))
-			return -ERESTARTSYS; /* tell the fs layer to handle it */
-		spin_lock(&scull_w_lock);
+		return -ERESTARTSYS; /* tell the fs layer to handle it */
 	}
-	if (scull_w_count == 0)
-		scull_w_owner = current_uid().val; /* grab it */
-	scull_w_count++;
+	scull_w_stats.wait_ns += waited;
+	if (waited > scull_w_stats.wait_ns_max)
+		scull_w_stats.wait_ns_max = waited;
 	spin_unlock(&scull_w_lock);
 
+  out:
 	/* then, everything else is copied from the bare scull device */
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+		scull_open_trim(dev);
 	filp->private_data = dev;
 	return 0;          /* success */
 }
 
 static int scull_w_release(struct inode *inode, struct file *filp)
 {
-	int temp;
-
+	scull_fasync(-1, filp, 0);
 	spin_lock(&scull_w_lock);
-	scull_w_count--;
-	temp = scull_w_count;
+	if (--scull_w_count == 0)
+		scull_w_handoff(); /* to the next uid, if any */
 	spin_unlock(&scull_w_lock);
+	return 0;
+}
+
+static long scull_w_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_w_stats stats;
 
-	if (temp == 0)
-		wake_up_interruptible_sync(&scull_w_wait); /* awake other uid's */
+	if (cmd != SCULL_W_IOCGSTATS)
+		return scull_ioctl(filp, cmd, arg);
+	spin_lock(&scull_w_lock);
+	stats = scull_w_stats;
+	spin_unlock(&scull_w_lock);
+	if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+		return -EFAULT;
 	return 0;
 }
 
@@ -218,7 +334,9 @@ struct file_operations scull_wusr_fops = {
 	.llseek =     scull_llseek,
 	.read =       scull_read,
 	.write =      scull_write,
-	.unlocked_ioctl = scull_ioctl,
+	.unlocked_ioctl = scull_w_ioctl,
+	.poll =       scull_poll,
+	.fasync =     scull_fasync,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
 };
@@ -229,46 +347,107 @@ struct file_operations scull_wusr_fops = {
  * involves list management, and dynamic allocation.
  */
 
-/* The clone-specific data structure includes a key field */
+/*
+ * The clone-specific data structure includes a key field: the tty for
+ * scullpriv, the uid for private sculluid devices. Clones are found by
+ * key in a hash table, without a lock: they are freed through RCU, and
+ * a lookup only counts if it can take a reference. Each open holds
+ * one, and so does the idle timer while it is pending, and the table
+ * itself for a clone kept until unload.
+ */
 
 struct scull_listitem {
 	struct scull_dev device;
-	dev_t key;
-	struct list_head list;
-    
+	int kind;			/* SCULL_C_TTY or SCULL_C_UID */
+	unsigned int key;
+	struct hlist_node node;
+	struct kref ref;
+	struct delayed_work idle;	/* frees it after scull_c_idle secs */
+	atomic_t kept;			/* 1 if the table holds a reference */
+	struct rcu_head rcu;
 };
 
-/* The list of devices, and a lock to protect it */
-static LIST_HEAD(scull_c_list);
+/* The table of devices, and a lock to protect changes to it */
+#define SCULL_C_HASH_BITS 10
+static DEFINE_HASHTABLE(scull_c_table, SCULL_C_HASH_BITS);
 static DEFINE_SPINLOCK(scull_c_lock);
 
+/*
+ * Seconds an unused clone is kept around; 0 frees it on last close.
+ * The default of -1 keeps it until the module is unloaded, as scull
+ * always did, with its data there for the next open.
+ */
+static int scull_c_idle = -1;
+module_param(scull_c_idle, int, 0644);
+
 /* A placeholder scull_dev which really just holds the cdev stuff. */
 static struct scull_dev scull_c_device;   
 
-/* Look for a device or create one if missing */
-static struct scull_dev *scull_c_lookfor_device(dev_t key)
+static void scull_c_free(struct kref *ref)
+{
+	struct scull_listitem *lptr = container_of(ref, struct scull_listitem, ref);
+
+	spin_lock(&scull_c_lock);
+	hash_del_rcu(&lptr->node);
+	spin_unlock(&scull_c_lock);
+	scull_trim(&lptr->device); /* nobody can get at it any more */
+	kfree_rcu(lptr, rcu); /* but a lookup may still be looking */
+}
+
+static void scull_c_expire(struct work_struct *work)
+{
+	struct scull_listitem *lptr = container_of(to_delayed_work(work),
+			struct scull_listitem, idle);
+
+	kref_put(&lptr->ref, scull_c_free);
+}
+
+/* Find a live device with this key and take a reference to it */
+static struct scull_listitem *scull_c_find(int kind, unsigned int key)
 {
 	struct scull_listitem *lptr;
 
-	list_for_each_entry(lptr, &scull_c_list, list) {
-		if (lptr->key == key)
-			return &(lptr->device);
+	hash_for_each_possible_rcu(scull_c_table, lptr, node, key) {
+		if (lptr->kind == kind && lptr->key == key &&
+				kref_get_unless_zero(&lptr->ref))
+			return lptr;
 	}
+	return NULL;
+}
 
-	/* not found */
-	lptr = kmalloc(sizeof(struct scull_listitem), GFP_KERNEL);
-	if (!lptr)
-		return NULL;
+/* Look for a device or create one if missing */
+static struct scull_dev *scull_c_lookfor_device(int kind, unsigned int key)
+{
+	struct scull_listitem *lptr, *new;
 
-	/* initialize the device */
-	memset(lptr, 0, sizeof(struct scull_listitem));
-	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&lptr->device.lock);
+	rcu_read_lock();
+	lptr = scull_c_find(kind, key);
+	rcu_read_unlock();
+	if (lptr)
+		return &(lptr->device);
 
-	/* place it in the list */
-	list_add(&lptr->list, &scull_c_list);
+	/* not found: make one, then check nobody beat us to it */
+	new = kmalloc(sizeof(struct scull_listitem), GFP_KERNEL);
+	if (!new)
+		return NULL;
+	memset(new, 0, sizeof(struct scull_listitem));
+	new->kind = kind;
+	new->key = key;
+	scull_trim(&(new->device)); /* initialize it */
+	mutex_init(&new->device.lock);
+	init_waitqueue_head(&new->device.inq);
+	kref_init(&new->ref);
+	INIT_DELAYED_WORK(&new->idle, scull_c_expire);
+
+	spin_lock(&scull_c_lock);
+	lptr = scull_c_find(kind, key);
+	if (!lptr)
+		hash_add_rcu(scull_c_table, &new->node, key);
+	spin_unlock(&scull_c_lock);
 
+	if (!lptr)
+		return &(new->device);
+	kfree(new);
 	return &(lptr->device);
 }
 
@@ -283,27 +462,39 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 	}
 	key = tty_devnum(current->signal->tty);
 
-	/* look for a scullc device in the list */
-	spin_lock(&scull_c_lock);
-	dev = scull_c_lookfor_device(key);
-	spin_unlock(&scull_c_lock);
-
+	/* look for a scullc device in the table */
+	dev = scull_c_lookfor_device(SCULL_C_TTY, key);
 	if (!dev)
 		return -ENOMEM;
 
 	/* then, everything else is copied from the bare scull device */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+		scull_open_trim(dev);
 	filp->private_data = dev;
 	return 0;          /* success */
 }
 
 static int scull_c_release(struct inode *inode, struct file *filp)
 {
+	struct scull_listitem *lptr = container_of(filp->private_data,
+			struct scull_listitem, device);
+	int idle = READ_ONCE(scull_c_idle);
+
+	scull_fasync(-1, filp, 0);
+
 	/*
-	 * Nothing to do, because the device is persistent.
-	 * A `real' cloned device should be freed on last close
+	 * Keep it for a while, if asked to: (re)arm the timer, which
+	 * holds a reference of its own unless it was already pending.
+	 * Or keep it for good, with a reference the table holds once.
 	 */
+	if (idle < 0 && !atomic_xchg(&lptr->kept, 1))
+		kref_get(&lptr->ref);
+	if (idle > 0) {
+		kref_get(&lptr->ref);
+		if (mod_delayed_work(system_wq, &lptr->idle, idle * HZ))
+			kref_put(&lptr->ref, scull_c_free); /* can't be the last */
+	}
+	kref_put(&lptr->ref, scull_c_free);
 	return 0;
 }
 
@@ -318,6 +509,8 @@ struct file_operations scull_priv_fops = {
 	.read =     scull_read,
 	.write =    scull_write,
 	.unlocked_ioctl = scull_ioctl,
+	.poll =     scull_poll,
+	.fasync =   scull_fasync,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
 };
@@ -351,6 +544,7 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
 	mutex_init(&dev->lock);
+	init_waitqueue_head(&dev->inq);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -390,8 +584,9 @@ int scull_access_init(dev_t firstdev)
  */
 void scull_access_cleanup(void)
 {
-	struct scull_listitem *lptr, *next;
-	int i;
+	struct scull_listitem *lptr;
+	struct hlist_node *tmp;
+	int i, bkt;
 
 	/* Clean up the static devs */
 	for (i = 0; i < SCULL_N_ADEVS; i++) {
@@ -400,11 +595,12 @@ void scull_access_cleanup(void)
 		scull_trim(scull_access_devs[i].sculldev);
 	}
 
-    	/* And all the cloned devices */
-	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
-		list_del(&lptr->list);
-		scull_trim(&(lptr->device));
-		kfree(lptr);
+    	/* And all the cloned devices: unused now, but maybe on a timer */
+	hash_for_each_safe(scull_c_table, bkt, tmp, lptr, node) {
+		if (cancel_delayed_work_sync(&lptr->idle))
+			kref_put(&lptr->ref, scull_c_free);
+		if (atomic_xchg(&lptr->kept, 0))
+			kref_put(&lptr->ref, scull_c_free);
 	}
 
 	/* Free up our number space */
@@ -0,0 +1,224 @@
+/*
+ * ctl.c -- scullctl, to make and remove devices at run time
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/module.h>
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/cdev.h>
+#include <linux/kobject.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * scullctl has a region of its own: minor 0 is scullctl itself, the
+ * others go to the devices it makes, found by minor in an idr.
+ */
+static dev_t scull_ctl_devno;
+static struct cdev scull_ctl_cdev;
+static DEFINE_IDR(scull_ctl_idr);
+static DEFINE_MUTEX(scull_ctl_lock);	/* protects the idr */
+
+/*
+ * A device made at run time. Its cdev holds a reference to the kobject
+ * here, and so does every file open on it through the cdev, so the
+ * device is only freed once it has been destroyed and its last file
+ * closed. The kobject isn't in sysfs: it's just a reference count.
+ */
+struct scull_dyn {
+	struct kobject kobj;
+	int minor;
+	struct scull_dev dev;		/* SCULL_CTL_SCULL */
+	struct scull_pipe *pipe;	/* SCULL_CTL_PIPE */
+};
+
+static void scull_dyn_release(struct kobject *kobj)
+{
+	struct scull_dyn *dyn = container_of(kobj, struct scull_dyn, kobj);
+
+	if (dyn->pipe)
+		scull_p_delete(dyn->pipe);
+	else
+		scull_trim(&dyn->dev);
+	kfree(dyn);
+}
+
+static struct kobj_type scull_dyn_ktype = {
+	.release = scull_dyn_release,
+};
+
+static struct cdev *scull_dyn_cdev(struct scull_dyn *dyn)
+{
+	return dyn->pipe ? scull_p_cdev(dyn->pipe) : &dyn->dev.cdev;
+}
+
+static int scull_ctl_create(struct scull_ctl_dev *req)
+{
+	struct scull_dyn *dyn;
+	struct cdev *cdev;
+	int minor, err;
+
+	if (req->type != SCULL_CTL_SCULL && req->type != SCULL_CTL_PIPE)
+		return -EINVAL;
+	if (req->quantum > SCULL_QUANTUM_MAX || req->qset > SCULL_QSET_MAX ||
+			req->buffer > INT_MAX || req->buffer == 1)
+		return -EINVAL;
+
+	dyn = kmalloc(sizeof(struct scull_dyn), GFP_KERNEL);
+	if (!dyn)
+		return -ENOMEM;
+	memset(dyn, 0, sizeof(struct scull_dyn));
+	kobject_init(&dyn->kobj, &scull_dyn_ktype);
+	if (req->type == SCULL_CTL_PIPE) {
+		dyn->pipe = scull_p_new(req->buffer);
+		if (!dyn->pipe) {
+			kobject_put(&dyn->kobj);
+			return -ENOMEM;
+		}
+	} else {
+		dyn->dev.quantum = req->quantum ? req->quantum : scull_quantum;
+		dyn->dev.qset = req->qset ? req->qset : scull_qset;
+		dyn->dev.pinned = req->quantum || req->qset;
+		mutex_init(&dyn->dev.lock);
+		init_waitqueue_head(&dyn->dev.inq);
+		cdev_init(&dyn->dev.cdev, &scull_fops);
+		dyn->dev.cdev.owner = THIS_MODULE;
+	}
+	cdev = scull_dyn_cdev(dyn);
+	cdev_set_parent(cdev, &dyn->kobj);
+
+	mutex_lock(&scull_ctl_lock);
+	minor = idr_alloc(&scull_ctl_idr, dyn, 1, SCULL_CTL_MINORS, GFP_KERNEL);
+	if (minor < 0) {
+		err = minor; /* -ENOSPC once they are all taken */
+		goto fail;
+	}
+	dyn->minor = minor;
+	err = cdev_add(cdev, MKDEV(MAJOR(scull_ctl_devno), minor), 1);
+	if (err) {
+		idr_remove(&scull_ctl_idr, minor);
+		goto fail;
+	}
+	mutex_unlock(&scull_ctl_lock);
+
+	req->major = MAJOR(scull_ctl_devno);
+	req->minor = minor;
+	return 0;
+
+  fail:
+	mutex_unlock(&scull_ctl_lock);
+	kobject_put(&dyn->kobj);
+	return err;
+}
+
+static int scull_ctl_destroy(unsigned long minor)
+{
+	struct scull_dyn *dyn;
+
+	if (minor == 0 || minor >= SCULL_CTL_MINORS)
+		return -EINVAL;
+	mutex_lock(&scull_ctl_lock);
+	dyn = idr_remove(&scull_ctl_idr, minor);
+	mutex_unlock(&scull_ctl_lock);
+	if (!dyn)
+		return -ENOENT;
+
+	cdev_del(scull_dyn_cdev(dyn)); /* no new opens; the minor is free */
+	kobject_put(&dyn->kobj); /* the rest goes with the last file */
+	return 0;
+}
+
+static long scull_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_ctl_dev req;
+	int retval;
+
+	switch(cmd) {
+
+	  case SCULL_CTL_IOCCREATE:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+			return -EFAULT;
+		retval = scull_ctl_create(&req);
+		if (retval)
+			return retval;
+		if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+			scull_ctl_destroy(req.minor); /* nobody would know of it */
+			return -EFAULT;
+		}
+		return 0;
+
+	  case SCULL_CTL_IOCDESTROY: /* arg is the minor */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		return scull_ctl_destroy(arg);
+
+	  default:
+		return -ENOTTY;
+	}
+}
+
+static struct file_operations scull_ctl_fops = {
+	.owner =	THIS_MODULE,
+	.unlocked_ioctl = scull_ctl_ioctl,
+};
+
+
+int scull_ctl_init(void)
+{
+	int result;
+
+	result = alloc_chrdev_region(&scull_ctl_devno, 0, SCULL_CTL_MINORS,
+			"scullctl");
+	if (result < 0) {
+		printk(KERN_WARNING "scullctl: can't get a major, error %d\n", result);
+		return result;
+	}
+	cdev_init(&scull_ctl_cdev, &scull_ctl_fops);
+	scull_ctl_cdev.owner = THIS_MODULE;
+	result = cdev_add(&scull_ctl_cdev, scull_ctl_devno, 1);
+	if (result) {
+		printk(KERN_NOTICE "Error %d adding scullctl\n", result);
+		unregister_chrdev_region(scull_ctl_devno, SCULL_CTL_MINORS);
+		scull_ctl_devno = 0;
+	}
+	return result;
+}
+
+/*
+ * This is called by cleanup_module or on failure. No file can be open
+ * on the devices by then, so destroying them frees them.
+ */
+void scull_ctl_cleanup(void)
+{
+	struct scull_dyn *dyn;
+	int minor;
+
+	if (!scull_ctl_devno)
+		return;
+	idr_for_each_entry(&scull_ctl_idr, dyn, minor)
+		scull_ctl_destroy(minor);
+	idr_destroy(&scull_ctl_idr);
+	cdev_del(&scull_ctl_cdev);
+	unregister_chrdev_region(scull_ctl_devno, SCULL_CTL_MINORS);
+	scull_ctl_devno = 0;
+}
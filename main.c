@@ -27,6 +27,20 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>	/* the repack runs in one */
+#include <linux/sched.h>	/* cond_resched() */
+#include <linux/math64.h>	/* div64_u64_rem() */
+#include <linux/log2.h>		/* is_power_of_2() */
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>	/* the log mode's pointer */
+#include <linux/sort.h>
+#include <linux/crc32c.h>
+#include <linux/xxhash.h>
+#include <linux/nodemask.h>	/* the online nodes */
+#include <linux/topology.h>	/* numa_node_id() */
+#include <linux/mm.h>		/* virt_to_page() */
 
 #include <linux/uaccess.h>	/* copy_*_user */
 
@@ -43,42 +57,322 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+long long scull_max_size = SCULL_MAX_SIZE;	/* no device grows past this */
+int scull_numa = SCULL_NUMA_LOCAL;	/* for devices left to the default */
+int scull_numa_node = 0;		/* with SCULL_NUMA_NODE */
+
+/* a size of 0 or less would turn every write away: don't take one */
+static int scull_set_max_size(const char *val, const struct kernel_param *kp)
+{
+	long long size;
+	int err = kstrtoll(val, 0, &size);
+
+	if (err)
+		return err;
+	if (size <= 0)
+		return -EINVAL;
+	WRITE_ONCE(*(long long *)kp->arg, size);
+	return 0;
+}
+
+static const struct kernel_param_ops scull_max_size_ops = {
+	.set = scull_set_max_size,
+	.get = param_get_llong,
+};
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param_cb(scull_max_size, &scull_max_size_ops, &scull_max_size,
+		S_IRUGO | S_IWUSR);
+module_param(scull_numa, int, S_IRUGO | S_IWUSR);
+module_param(scull_numa_node, int, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
+/*
+ * A device whose geometry is being changed while it holds data: its
+ * data is copied into a new list, in the new geometry, by a work item.
+ * It takes the semaphore for one quantum at a time, so readers go on
+ * with the old list in between; writers wait on scull_repack_wait
+ * until the new list replaces it. The work holds a reference to the
+ * file that asked for it, so the device can't go away meanwhile.
+ */
+struct scull_repack {
+	struct work_struct work;
+	struct scull_dev *dev;
+	struct file *filp;
+	struct scull_qset *data;	/* the new list */
+	int quantum, qset;		/* the new geometry */
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(scull_repack_wait);
+static struct workqueue_struct *scull_repack_wq; /* flushed on unload */
+
 
 /*
- * Empty out the scull device; must be called with the device
- * semaphore held.
+ * NUMA placement, see SCULL_IOCSNUMA. The node for the next allocation
+ * of a device, or NUMA_NO_NODE to leave it to the allocator (the node
+ * we run on, as kmalloc() always did). Only a writer picks the node of
+ * SCULL_NUMA_FIRST; until one has, the others leave it to the allocator.
  */
-int scull_trim(struct scull_dev *dev)
+int scull_place_node(struct scull_place *pl, int writer)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
+	int policy = READ_ONCE(pl->policy), node = READ_ONCE(pl->node);
+	int first;
 
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
+	if (policy == SCULL_NUMA_DEFAULT) {
+		policy = READ_ONCE(scull_numa);
+		node = READ_ONCE(scull_numa_node);
+	}
+	switch (policy) {
+	  case SCULL_NUMA_NODE:
+		break;
+	  case SCULL_NUMA_FIRST:
+		if (writer)
+			first = cmpxchg(&pl->first, 0, numa_node_id() + 1);
+		else if (!(first = READ_ONCE(pl->first)))
+			return NUMA_NO_NODE;
+		node = first ? first - 1 : numa_node_id();
+		break;
+	  case SCULL_NUMA_INTERLEAVE:
+		node = next_online_node(READ_ONCE(pl->next));
+		if (node >= MAX_NUMNODES)
+			node = first_online_node;
+		WRITE_ONCE(pl->next, node);
+		break;
+	  default:
+		return NUMA_NO_NODE;
+	}
+	if (node < 0 || node >= nr_node_ids || !node_online(node))
+		return NUMA_NO_NODE; /* the parameter may say anything */
+	return node;
+}
+
+/*
+ * Allocate on a node and count it there: the bytes go to the node the
+ * memory really came from, which for NUMA_NO_NODE or a node short of
+ * memory may not be the one asked for.
+ */
+void *scull_place_alloc(struct scull_place *pl, size_t size, gfp_t flags,
+		int node)
+{
+	atomic_long_t *bytes = READ_ONCE(pl->bytes);
+	void *p;
+
+	if (!bytes) { /* log mode grows the list without the semaphore */
+		bytes = kcalloc(nr_node_ids, sizeof(*bytes), GFP_KERNEL);
+		if (!bytes)
+			return NULL;
+		if (cmpxchg(&pl->bytes, NULL, bytes)) {
+			kfree(bytes);
+			bytes = pl->bytes;
 		}
+	}
+	p = kmalloc_node(size, flags, node);
+	if (p)
+		atomic_long_add(ksize(p), &bytes[page_to_nid(virt_to_page(p))]);
+	return p;
+}
+
+void scull_place_free(struct scull_place *pl, const void *p)
+{
+	if (!p)
+		return;
+	atomic_long_sub(ksize(p), &pl->bytes[page_to_nid(virt_to_page(p))]);
+	kfree(p);
+}
+
+/*
+ * Once everything allocated through it is freed: drop the counters,
+ * and let the next writer be the first one.
+ */
+void scull_place_reset(struct scull_place *pl)
+{
+	kfree(pl->bytes);
+	pl->bytes = NULL;
+	pl->first = 0;
+}
+
+int scull_place_set(struct scull_place *pl, struct scull_numa *numa)
+{
+	if (numa->policy > SCULL_NUMA_INTERLEAVE)
+		return -EINVAL;
+	if (numa->policy == SCULL_NUMA_NODE && (numa->node < 0 ||
+			numa->node >= nr_node_ids || !node_online(numa->node)))
+		return -EINVAL;
+	if (numa->policy == SCULL_NUMA_NODE)
+		WRITE_ONCE(pl->node, numa->node);
+	WRITE_ONCE(pl->policy, numa->policy);
+	return 0;
+}
+
+/* adds to numa->bytes, so a pipe can report its spill area as well */
+void scull_place_get(struct scull_place *pl, struct scull_numa *numa)
+{
+	int nid;
+
+	numa->policy = pl->policy;
+	numa->node = pl->policy == SCULL_NUMA_NODE ? pl->node : -1;
+	if (pl->policy == SCULL_NUMA_FIRST ||
+			(pl->policy == SCULL_NUMA_DEFAULT && scull_numa == SCULL_NUMA_FIRST))
+		numa->node = pl->first - 1;
+	if (!pl->bytes)
+		return;
+	for (nid = 0; nid < min_t(int, nr_node_ids, SCULL_NUMA_NODES); nid++)
+		numa->bytes[nid] += atomic_long_read(&pl->bytes[nid]);
+}
+
+/* always for a writer: a reader leaves a hole as it is */
+static void *scull_alloc(struct scull_dev *dev, size_t size, gfp_t flags)
+{
+	return scull_place_alloc(&dev->place, size, flags,
+			scull_place_node(&dev->place, 1));
+}
+
+/*
+ * Free a list item and the quanta it holds.
+ */
+static void scull_free_qset(struct scull_dev *dev, struct scull_qset *dptr)
+{
+	int i;
+
+	for (i = 0; i < dptr->nr; i++)
+		scull_place_free(&dev->place, dptr->data[i]);
+	scull_place_free(&dev->place, dptr->data);
+	scull_place_free(&dev->place, dptr);
+}
+
+static void scull_free_list(struct scull_dev *dev, struct scull_qset *dptr)
+{
+	struct scull_qset *next;
+
+	for (; dptr; dptr = next) { /* all the list items */
 		next = dptr->next;
-		kfree(dptr);
+		scull_free_qset(dev, dptr);
 	}
+}
+
+/*
+ * A list item's array starts small and doubles as quanta further into
+ * it are written, up to the device's qset, so an item holding one
+ * quantum doesn't pay for a thousand pointers.
+ */
+static int scull_qset_grow(struct scull_dev *dev, struct scull_qset *dptr,
+		int s_pos, int qset)
+{
+	unsigned long nr;
+	void **data;
+
+	if (s_pos < dptr->nr)
+		return 0;
+	/* unsigned long: rounded up in an int, a big s_pos would wrap */
+	nr = min_t(unsigned long, max_t(unsigned long,
+			roundup_pow_of_two((unsigned long)s_pos + 1), SCULL_QSET_MIN),
+			qset);
+	if (nr <= s_pos || nr > SIZE_MAX / sizeof(char *))
+		return -EINVAL;
+	/* not krealloc(): the new array goes where the policy says */
+	data = scull_alloc(dev, nr * sizeof(char *), GFP_KERNEL | __GFP_ZERO);
+	if (!data)
+		return -ENOMEM;
+	if (dptr->nr)
+		memcpy(data, dptr->data, dptr->nr * sizeof(char *));
+	scull_place_free(&dev->place, dptr->data);
+	dptr->data = data;
+	dptr->nr = nr;
+	return 0;
+}
+
+/*
+ * A place in a list: the link to item "item". Going through a list in
+ * order from one, nothing is walked twice.
+ */
+struct scull_cursor {
+	struct scull_qset **pp;
+	loff_t item;
+};
+
+/*
+ * Log mode (SCULL_IOCTLOG): every write appends, and writers don't
+ * take the device semaphore. A writer reserves its bytes by moving
+ * "tail" on, fills them in parallel with the others, then waits for
+ * those before it to commit and moves "committed" on; readers see the
+ * device end there, so only whole writes. The list is only ever grown
+ * (under "grow"), with full arrays and whole quanta up to "room", so
+ * the space behind a reservation is already there and never moves.
+ * Writers find their quanta from "base", which the committer moves
+ * on, so they only walk past the writes still in flight. A writer
+ * killed while waiting to commit leaves its range on "orphans", for
+ * whoever commits up to it to commit too.
+ */
+struct scull_log {
+	atomic64_t tail;		/* reserved up to here */
+	atomic64_t committed;		/* written up to here */
+	atomic64_t room;		/* allocated up to here */
+	atomic_t writers;		/* 1 for the mode, plus one per write */
+	wait_queue_head_t commit;	/* writers waiting to commit */
+	struct mutex grow;		/* to add to the list */
+	struct scull_qset *last;	/* its last item */
+	loff_t items;			/* and how many there are */
+	struct scull_cursor at;		/* where "room" is, for growing */
+	int quantum, qset;		/* can't change meanwhile */
+	seqlock_t baselock;
+	struct scull_cursor base;	/* an item not after "committed" */
+	spinlock_t orphanlock;
+	struct list_head orphans;	/* commits left by killed writers */
+};
+
+struct scull_log_orphan {
+	struct list_head list;
+	loff_t start, end;
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(scull_log_idle);
+
+/*
+ * Leave log mode, once the writes in progress are done. Called with
+ * the device semaphore held, so no reader is about either, or by the
+ * last user of the device.
+ */
+static void scull_log_stop(struct scull_dev *dev)
+{
+	struct scull_log *log = rcu_dereference_protected(dev->log, 1);
+
+	if (!log)
+		return;
+	rcu_assign_pointer(dev->log, NULL);
+	synchronize_rcu(); /* no new writer can find it now */
+	atomic_dec(&log->writers);
+	wait_event(scull_log_idle, !atomic_read(&log->writers));
+	dev->size = atomic64_read(&log->committed);
+	WARN_ON(!list_empty(&log->orphans)); /* their committers are gone too */
+	kfree(log);
+}
+
+/*
+ * Empty out the scull device; must be called with the device
+ * semaphore held.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+	scull_log_stop(dev);
+	scull_free_list(dev, dev->data);
+	scull_place_reset(&dev->place);
+	dev->ring = 0;
+	kfree(dev->small);
+	dev->small = NULL;
+	dev->smallroom = 0;
 	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
+	if (!dev->pinned) {
+		dev->quantum = scull_quantum;
+		dev->qset = scull_qset;
+	}
 	dev->data = NULL;
 	return 0;
 }
@@ -97,13 +391,13 @@ int scull_read_procmem(struct seq_file *s, void *v)
                 struct scull_qset *qs = d->data;
                 if (mutex_lock_interruptible(&d->lock))
                         return -ERESTARTSYS;
-                seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
-                             i, d->qset, d->quantum, d->size);
+                seq_printf(s,"\nDevice %i: qset %i, q %i, sz %lli\n",
+                             i, d->qset, d->quantum, (long long)d->size);
                 for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
                         seq_printf(s, "  item at %p, qset at %p\n",
                                      qs, qs->data);
                         if (qs->data && !qs->next) /* dump only the last item */
-                                for (j = 0; j < d->qset; j++) {
+                                for (j = 0; j < qs->nr; j++) {
                                         if (qs->data[j])
                                                 seq_printf(s, "    % 4i: %8p\n",
                                                              j, qs->data[j]);
@@ -114,279 +408,1638 @@ int scull_read_procmem(struct seq_file *s, void *v)
         return 0;
 }
 
-
-
+
+
+/*
+ * Here are our sequence iteration methods.  Our "position" is
+ * simply the device number.
+ */
+static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+{
+	if (*pos >= scull_nr_devs)
+		return NULL;   /* No more to read */
+	return scull_devices + *pos;
+}
+
+static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	(*pos)++;
+	if (*pos >= scull_nr_devs)
+		return NULL;
+	return scull_devices + *pos;
+}
+
+static void scull_seq_stop(struct seq_file *s, void *v)
+{
+	/* Actually, there's nothing to do here */
+}
+
+static int scull_seq_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = (struct scull_dev *) v;
+	struct scull_qset *d;
+	int i;
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %lli\n",
+			(int) (dev - scull_devices), dev->qset,
+			dev->quantum, (long long)dev->size);
+	if (dev->small)
+		seq_printf(s, "  small at %p, room %i\n", dev->small,
+				dev->smallroom);
+	for (d = dev->data; d; d = d->next) { /* scan the list */
+		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
+		if (d->data && !d->next) /* dump only the last item */
+			for (i = 0; i < d->nr; i++) {
+				if (d->data[i])
+					seq_printf(s, "    % 4i: %8p\n",
+							i, d->data[i]);
+			}
+	}
+	mutex_unlock(&dev->lock);
+	return 0;
+}
+	
+/*
+ * Tie the sequence operators up.
+ */
+static struct seq_operations scull_seq_ops = {
+	.start = scull_seq_start,
+	.next  = scull_seq_next,
+	.stop  = scull_seq_stop,
+	.show  = scull_seq_show
+};
+
+/*
+ * Now to implement the /proc files we need only make an open
+ * method which sets up the sequence operators.
+ */
+static int scullmem_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_read_procmem, NULL);
+}
+
+static int scullseq_proc_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &scull_seq_ops);
+}
+
+/*
+ * Create a set of file operations for our proc files.
+ */
+static struct file_operations scullmem_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scullmem_proc_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+static struct file_operations scullseq_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scullseq_proc_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release
+};
+	
+
+/*
+ * Actually create (and remove) the /proc file(s).
+ */
+
+static void scull_create_proc(void)
+{
+	proc_create_data("scullmem", 0 /* default mode */,
+			NULL /* parent dir */, proc_ops_wrapper(&scullmem_proc_ops, scullmem_pops),
+			NULL /* client data */);
+	proc_create("scullseq", 0, NULL, proc_ops_wrapper(&scullseq_proc_ops, scullseq_pops));
+}
+
+static void scull_remove_proc(void)
+{
+	/* no problem if it was not registered */
+	remove_proc_entry("scullmem", NULL /* parent dir */);
+	remove_proc_entry("scullseq", NULL);
+}
+
+
+#endif /* SCULL_DEBUG */
+
+
+
+
+
+/*
+ * Take the device semaphore to change the data, which can't be done
+ * while it's being repacked. Only interruptible if asked to.
+ */
+static int scull_lock_data(struct scull_dev *dev, int interruptible)
+{
+	for (;;) {
+		if (!interruptible)
+			mutex_lock(&dev->lock);
+		else if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		if (!dev->repack)
+			return 0;
+		mutex_unlock(&dev->lock);
+		if (!interruptible)
+			wait_event(scull_repack_wait, !READ_ONCE(dev->repack));
+		else if (wait_event_interruptible(scull_repack_wait,
+				!READ_ONCE(dev->repack)))
+			return -ERESTARTSYS;
+	}
+}
+
+/*
+ * Open and close
+ */
+
+int scull_open(struct inode *inode, struct file *filp)
+{
+	struct scull_dev *dev; /* device information */
+
+	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+	filp->private_data = dev; /* for other methods */
+
+	/* now trim to 0 the length of the device if open was write-only */
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY &&
+			!(filp->f_flags & O_APPEND)) {
+		if (scull_lock_data(dev, 1))
+			return -ERESTARTSYS;
+		if (!dev->ring) /* a recorder keeps what it has */
+			scull_trim(dev); /* ignore errors */
+		mutex_unlock(&dev->lock);
+	}
+	return 0;          /* success */
+}
+
+/*
+ * The same for the devices in access.c, which can't easily back
+ * out of an open once they have let the caller in.
+ */
+void scull_open_trim(struct scull_dev *dev)
+{
+	scull_lock_data(dev, 0);
+	if (!dev->ring)
+		scull_trim(dev);
+	mutex_unlock(&dev->lock);
+}
+
+int scull_release(struct inode *inode, struct file *filp)
+{
+	/* remove this filp from the asynchronously notified filp's */
+	scull_fasync(-1, filp, 0);
+	return 0;
+}
+/*
+ * Follow the list
+ */
+struct scull_qset *scull_follow(struct scull_dev *dev, loff_t n)
+{
+	struct scull_qset *qs = dev->data;
+
+        /* Allocate first qset explicitly if need be */
+	if (! qs) {
+		qs = dev->data = scull_alloc(dev, sizeof(struct scull_qset),
+				GFP_KERNEL | __GFP_ZERO);
+		if (qs == NULL)
+			return NULL;  /* Never mind */
+	}
+
+	/* Then follow the list */
+	while (n--) {
+		if (!qs->next) {
+			qs->next = scull_alloc(dev, sizeof(struct scull_qset),
+					GFP_KERNEL | __GFP_ZERO);
+			if (qs->next == NULL)
+				return NULL;  /* Never mind */
+		}
+		qs = qs->next;
+		continue;
+	}
+	return qs;
+}
+
+/*
+ * Drop the first list item, moving the rest of the data back by its
+ * size; the elastic pipe consumes its spill area from the front this
+ * way. Must be called with the device semaphore held.
+ */
+void scull_shift(struct scull_dev *dev)
+{
+	struct scull_qset *dptr = dev->data;
+	loff_t itemsize = (loff_t)dev->quantum * dev->qset;
+
+	if (dev->small) { /* no list item: move the bytes themselves */
+		itemsize = min(itemsize, dev->size);
+		memmove(dev->small, dev->small + itemsize, dev->size - itemsize);
+		dev->size -= itemsize;
+		return;
+	}
+	if (!dptr)
+		return;
+	dev->data = dptr->next;
+	scull_free_qset(dev, dptr);
+	dev->size = dev->size > itemsize ? dev->size - itemsize : 0;
+}
+
+/*
+ * Find the list item, the quantum in it and the offset in that quantum
+ * for byte "pos". An item can hold more than an int, and on 32-bit a
+ * device more than a long, so this is all done in 64 bits. Power of
+ * two geometries (SCULL_IOCSGEOMETRY with 4096 and 1024, say) get
+ * shifts and masks instead of the divisions.
+ */
+static void scull_split(loff_t pos, int quantum, int qset, loff_t *item,
+		int *s_pos, int *q_pos)
+{
+	int qshift;
+	u64 rest;
+	u32 offset;
+
+	if (is_power_of_2(quantum) && is_power_of_2(qset)) {
+		qshift = __ffs(quantum);
+		*item = pos >> (qshift + __ffs(qset));
+		*s_pos = (pos >> qshift) & (qset - 1);
+		*q_pos = pos & (quantum - 1);
+		return;
+	}
+	*item = div64_u64_rem(pos, (u64)quantum * qset, &rest);
+	*s_pos = div_u64_rem(rest, quantum, &offset);
+	*q_pos = offset;
+}
+
+/*
+ * Where is byte "pos" in a list of this geometry, and how many bytes
+ * are there from it to the end of its quantum? NULL for a hole, or
+ * when "create" is set and it can't be allocated. For copying data
+ * around in the kernel: repacking and promoting small contents. The
+ * list is walked from the cursor, which is left at pos's item, so
+ * pos must not be before that.
+ */
+static char *scull_at_from(struct scull_dev *dev, struct scull_cursor *cur,
+		int quantum, int qset, loff_t pos, int create, int *len)
+{
+	struct scull_qset *dptr;
+	int s_pos, q_pos;
+	loff_t item;
+
+	scull_split(pos, quantum, qset, &item, &s_pos, &q_pos);
+
+	*len = quantum - q_pos;
+	for (;;) {
+		if (!*cur->pp) {
+			if (!create)
+				return NULL;
+			*cur->pp = scull_alloc(dev, sizeof(struct scull_qset),
+					GFP_KERNEL | __GFP_ZERO);
+			if (!*cur->pp)
+				return NULL;
+		}
+		if (cur->item == item)
+			break;
+		cur->pp = &(*cur->pp)->next;
+		cur->item++;
+	}
+	dptr = *cur->pp;
+	if (s_pos >= dptr->nr) {
+		if (!create || scull_qset_grow(dev, dptr, s_pos, qset))
+			return NULL;
+	}
+	if (!dptr->data[s_pos]) {
+		if (!create)
+			return NULL;
+		dptr->data[s_pos] = scull_alloc(dev, quantum, GFP_KERNEL);
+		if (!dptr->data[s_pos])
+			return NULL;
+	}
+	return dptr->data[s_pos] + q_pos;
+}
+
+/* the same, from the head of the list */
+static char *scull_at(struct scull_dev *dev, struct scull_qset **list,
+		int quantum, int qset, loff_t pos, int create, int *len)
+{
+	struct scull_cursor cur = { list, 0 };
+
+	return scull_at_from(dev, &cur, quantum, qset, pos, create, len);
+}
+
+/*
+ * Small contents, up to SCULL_SMALL_MAX bytes, are kept in one buffer
+ * just big enough for them (rounded up to a power of two), instead of
+ * a list item, its array and a whole quantum. They move to the usual
+ * list when a write would take them past that; dev->data and
+ * dev->small are never both in use.
+ */
+static ssize_t scull_small_write(struct scull_dev *dev, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	size_t end = *f_pos + count;
+	char *small;
+	int room;
+
+	if (end > dev->smallroom) {
+		room = roundup_pow_of_two(end);
+		small = krealloc(dev->small, room, GFP_KERNEL);
+		if (!small)
+			return -ENOMEM;
+		dev->small = small;
+		dev->smallroom = room;
+	}
+	if (*f_pos > dev->size) /* a hole: it reads as zeroes */
+		memset(dev->small + dev->size, 0, *f_pos - dev->size);
+	if (copy_from_user(dev->small + *f_pos, buf, count))
+		return -EFAULT;
+	*f_pos += count;
+	if (dev->size < *f_pos)
+		dev->size = *f_pos;
+	return count;
+}
+
+static int scull_promote(struct scull_dev *dev)
+{
+	long pos = 0;
+	char *dst;
+	int len;
+
+	while (pos < dev->size) {
+		dst = scull_at(dev, &dev->data, dev->quantum, dev->qset, pos, 1, &len);
+		if (!dst) {
+			scull_free_list(dev, dev->data);
+			dev->data = NULL;
+			return -ENOMEM;
+		}
+		len = min_t(long, len, dev->size - pos);
+		memcpy(dst, dev->small + pos, len);
+		pos += len;
+	}
+	kfree(dev->small);
+	dev->small = NULL;
+	dev->smallroom = 0;
+	return 0;
+}
+
+/*
+ * Log mode, see struct scull_log. Called with the device semaphore
+ * held; the list is grown to full arrays, as the writers will look
+ * up their quanta without any lock.
+ */
+static int scull_log_start(struct scull_dev *dev)
+{
+	struct scull_log *log;
+	struct scull_qset *dptr;
+
+	if (rcu_access_pointer(dev->log))
+		return 0;
+	if (dev->ring)
+		return -EBUSY;
+	log = kzalloc(sizeof(struct scull_log), GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+	if (dev->small && scull_promote(dev))
+		goto nomem;
+	for (dptr = dev->data; dptr; dptr = dptr->next) {
+		if (scull_qset_grow(dev, dptr, dev->qset - 1, dev->qset))
+			goto nomem;
+		log->last = dptr;
+		log->items++;
+	}
+	atomic64_set(&log->tail, dev->size);
+	atomic64_set(&log->committed, dev->size);
+	atomic64_set(&log->room, dev->size);
+	atomic_set(&log->writers, 1);
+	init_waitqueue_head(&log->commit);
+	mutex_init(&log->grow);
+	log->quantum = dev->quantum;
+	log->qset = dev->qset;
+	log->at.pp = &dev->data;
+	seqlock_init(&log->baselock);
+	log->base.pp = &dev->data;
+	spin_lock_init(&log->orphanlock);
+	INIT_LIST_HEAD(&log->orphans);
+	rcu_assign_pointer(dev->log, log);
+	return 0;
+
+  nomem:
+	kfree(log);
+	return -ENOMEM;
+}
+
+/*
+ * Allocate the log's quanta up to "want", and some more so the next
+ * writers needn't come here.
+ */
+static int scull_log_grow(struct scull_dev *dev, struct scull_log *log,
+		loff_t want)
+{
+	int quantum = log->quantum, qset = log->qset;
+	loff_t room, end;
+	struct scull_qset *dptr;
+	int s_pos, q_pos, len;
+	loff_t item;
+
+	mutex_lock(&log->grow);
+	room = atomic64_read(&log->room);
+	end = min_t(loff_t, want + (loff_t)SCULL_LOG_AHEAD * quantum,
+			max(want, READ_ONCE(scull_max_size)));
+	while (room < end) {
+		scull_split(room, quantum, qset, &item, &s_pos, &q_pos);
+		while (log->items <= item) {
+			dptr = scull_alloc(dev, sizeof(struct scull_qset),
+					GFP_KERNEL | __GFP_ZERO);
+			if (dptr)
+				dptr->data = scull_alloc(dev, qset * sizeof(char *),
+						GFP_KERNEL | __GFP_ZERO);
+			if (!dptr || !dptr->data) {
+				scull_place_free(&dev->place, dptr);
+				goto out;
+			}
+			dptr->nr = qset;
+			if (log->last)
+				smp_store_release(&log->last->next, dptr);
+			else
+				smp_store_release(&dev->data, dptr);
+			log->last = dptr;
+			log->items++;
+		}
+		/*
+		 * Not necessarily in the last item: the list may go on past
+		 * the end (a far write that failed leaves items behind).
+		 */
+		if (!scull_at_from(dev, &log->at, quantum, qset, room, 1, &len))
+			goto out;
+		room += len;
+	}
+  out:
+	atomic64_set_release(&log->room, room); /* after the list is set up */
+	mutex_unlock(&log->grow);
+	return room >= want ? 0 : -ENOMEM;
+}
+
+/*
+ * Move "committed" on to "end", and on past the orphans that follow.
+ * Only the writer whose range starts at "committed" gets here, so
+ * there's one at a time.
+ */
+static void scull_log_commit(struct scull_log *log, loff_t end)
+{
+	struct scull_log_orphan *o, *next;
+	struct scull_cursor base;
+	int s_pos, q_pos;
+	loff_t item;
+
+	spin_lock(&log->orphanlock);
+  again:
+	list_for_each_entry_safe(o, next, &log->orphans, list) {
+		if (o->start == end) {
+			end = o->end;
+			list_del(&o->list);
+			kfree(o);
+			goto again;
+		}
+	}
+	atomic64_set_release(&log->committed, end);
+	spin_unlock(&log->orphanlock);
+
+	scull_split(end, log->quantum, log->qset, &item, &s_pos, &q_pos);
+	base = log->base;
+	while (base.item < item && *base.pp) {
+		base.pp = &(*base.pp)->next;
+		base.item++;
+	}
+	write_seqlock(&log->baselock);
+	log->base = base;
+	write_sequnlock(&log->baselock);
+
+	if (wq_has_sleeper(&log->commit))
+		wake_up_all(&log->commit);
+}
+
+/*
+ * A fatal signal while waiting to commit: leave the range for the
+ * writer before to commit. Returns 0 if it's our turn after all, so
+ * we commit it ourselves.
+ */
+static int scull_log_orphan(struct scull_log *log, loff_t start, loff_t end)
+{
+	struct scull_log_orphan *o;
+
+	o = kmalloc(sizeof(struct scull_log_orphan), GFP_KERNEL);
+	if (!o) {
+		wait_event(log->commit,
+			atomic64_read_acquire(&log->committed) == start);
+		return 0;
+	}
+	o->start = start;
+	o->end = end;
+	spin_lock(&log->orphanlock);
+	if (atomic64_read(&log->committed) == start) {
+		spin_unlock(&log->orphanlock);
+		kfree(o);
+		return 0;
+	}
+	list_add(&o->list, &log->orphans);
+	spin_unlock(&log->orphanlock);
+	return -EINTR;
+}
+
+static ssize_t scull_log_append(struct scull_dev *dev, struct scull_log *log,
+		const char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct scull_cursor cur;
+	loff_t start, len, done;
+	ssize_t retval;
+	unsigned int seq;
+	char *dst;
+	int chunk;
+
+	/*
+	 * Reserve, but only what is already allocated: a reservation that
+	 * then couldn't be filled would hold up every writer after it.
+	 */
+	start = atomic64_read(&log->tail);
+	do {
+		if (start >= READ_ONCE(scull_max_size))
+			return -EFBIG;
+		len = min_t(loff_t, count, READ_ONCE(scull_max_size) - start);
+		if (start + len > atomic64_read_acquire(&log->room) &&
+				scull_log_grow(dev, log, start + len))
+			return -ENOMEM;
+	} while (!atomic64_try_cmpxchg(&log->tail, &start, start + len));
+
+	/* the space is ours alone: fill it in without any lock */
+	do {
+		seq = read_seqbegin(&log->baselock);
+		cur = log->base; /* not after "committed", so not after us */
+	} while (read_seqretry(&log->baselock, seq));
+	retval = len;
+	for (done = 0; done < len; done += chunk) {
+		dst = scull_at_from(dev, &cur, log->quantum, log->qset,
+				start + done, 0, &chunk);
+		chunk = min_t(loff_t, chunk, len - done);
+		if (WARN_ON_ONCE(!dst)) { /* can't be: it was all there */
+			retval = -EIO; /* committed anyway, it reads as zeroes */
+			continue;
+		}
+		if (retval > 0 && copy_from_user(dst, buf + done, chunk))
+			retval = -EFAULT;
+		if (retval < 0)
+			memset(dst, 0, chunk); /* it gets committed all the same */
+	}
+
+	/* commit in order: the writers that reserved before us go first */
+	if (wait_event_killable(log->commit,
+			atomic64_read_acquire(&log->committed) == start) &&
+			scull_log_orphan(log, start, start + len))
+		return -EINTR;
+	scull_log_commit(log, start + len);
+	*f_pos = start + len;
+	return retval;
+}
+
+/*
+ * Returns 0 if the device isn't in log mode, for the usual write.
+ */
+static ssize_t scull_log_write(struct scull_dev *dev, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct scull_log *log;
+	ssize_t retval;
+
+	if (!count)
+		return 0;
+	rcu_read_lock();
+	log = rcu_dereference(dev->log);
+	if (log && !atomic_inc_not_zero(&log->writers))
+		log = NULL; /* on its way out */
+	rcu_read_unlock();
+	if (!log)
+		return 0;
+	retval = scull_log_append(dev, log, buf, count, f_pos);
+	if (atomic_dec_and_test(&log->writers))
+		wake_up_all(&scull_log_idle);
+	return retval;
+}
+
+/*
+ * How much a reader can see: in log mode, what has been committed.
+ */
+static loff_t scull_size(struct scull_dev *dev)
+{
+	struct scull_log *log;
+	loff_t size;
+
+	rcu_read_lock();
+	log = rcu_dereference(dev->log);
+	size = log ? atomic64_read_acquire(&log->committed) : dev->size;
+	rcu_read_unlock();
+	return size;
+}
+
+/*
+ * Ring mode (SCULL_IOCSRING): a flight recorder. The device keeps only
+ * the last dev->ring bytes written, in quanta allocated when the mode
+ * starts; byte "pos" lives at pos % dev->ring, and writes go on over
+ * the oldest data. Offsets keep counting up, so a reader can tell what
+ * it missed, and SEEK_DATA finds the oldest byte still there.
+ * Called with the device semaphore held. More than SCULL_RING_MAX
+ * takes CAP_SYS_ADMIN, as it is all allocated here and now.
+ */
+static int scull_ring_start(struct scull_dev *dev, u64 size)
+{
+	struct scull_cursor cur = { &dev->data, 0 };
+	loff_t pos;
+	int len;
+
+	scull_trim(dev); /* leaves ring mode, and log mode */
+	if (!size)
+		return 0;
+	if (size > scull_max_size)
+		return -EFBIG;
+	if (size > SCULL_RING_MAX && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	size = div64_u64(size + dev->quantum - 1, dev->quantum) * dev->quantum;
+	for (pos = 0; pos < size; pos += dev->quantum) {
+		if (fatal_signal_pending(current)) {
+			scull_trim(dev);
+			return -EINTR;
+		}
+		if (!scull_at_from(dev, &cur, dev->quantum, dev->qset, pos, 1, &len)) {
+			scull_trim(dev);
+			return -ENOMEM;
+		}
+		cond_resched();
+	}
+	dev->ring = size;
+	return 0;
+}
+
+static loff_t scull_ring_oldest(struct scull_dev *dev, loff_t size)
+{
+	loff_t ring = READ_ONCE(dev->ring);
+
+	return size > ring ? size - ring : 0;
+}
+
+/* where byte "pos" is, and how much of the quantum is left there */
+static char *scull_ring_at(struct scull_dev *dev, loff_t pos, int *len)
+{
+	u64 phys;
+
+	div64_u64_rem(pos, dev->ring, &phys);
+	return scull_at(dev, &dev->data, dev->quantum, dev->qset, phys, 0, len);
+}
+
+static ssize_t scull_ring_write(struct scull_dev *dev, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	char *dst;
+	int len;
+
+	dst = scull_ring_at(dev, dev->size, &len); /* always at the end */
+	if (!dst)
+		return -ENOMEM; /* can't happen: it's all allocated */
+	if (count > len)
+		count = len;
+	if (copy_from_user(dst, buf, count))
+		return -EFAULT;
+	dev->size += count;
+	*f_pos = dev->size;
+	return count;
+}
+
+/*
+ * Free the quanta wholly inside [from, to), and a list item's array
+ * once it holds none; zero what's left of the quanta at either end.
+ * List items themselves stay, as their place in the list is their
+ * offset, unless scull_set_size() drops the ones past the end.
+ * Called with the device semaphore held.
+ */
+static void scull_punch(struct scull_dev *dev, loff_t from, loff_t to)
+{
+	loff_t itemsize = (loff_t)dev->quantum * dev->qset;
+	loff_t base, qbase, start, end;
+	struct scull_qset *dptr;
+	int i, used;
+
+	to = min(to, dev->size);
+	if (from >= to)
+		return;
+	if (dev->small) {
+		memset(dev->small + from, 0, to - from);
+		return;
+	}
+	for (dptr = dev->data, base = 0; dptr && base < to;
+			dptr = dptr->next, base += itemsize) {
+		if (base + itemsize <= from)
+			continue;
+		used = 0;
+		for (i = 0; i < dptr->nr; i++) {
+			if (!dptr->data[i])
+				continue;
+			qbase = base + (loff_t)i * dev->quantum;
+			start = max(from, qbase);
+			end = min(to, qbase + dev->quantum);
+			if (start >= end) {
+				used = 1; /* outside the range */
+			} else if (end - start == dev->quantum) {
+				scull_place_free(&dev->place, dptr->data[i]);
+				dptr->data[i] = NULL;
+			} else {
+				memset(dptr->data[i] + (start - qbase), 0, end - start);
+				used = 1;
+			}
+		}
+		if (!used) {
+			scull_place_free(&dev->place, dptr->data);
+			dptr->data = NULL;
+			dptr->nr = 0;
+		}
+		cond_resched();
+	}
+}
+
+/*
+ * Like ftruncate(): drop everything past "size", or grow the device
+ * with a hole up to it. Called with the device semaphore held.
+ */
+static int scull_set_size(struct scull_dev *dev, loff_t size)
+{
+	loff_t itemsize = (loff_t)dev->quantum * dev->qset, old = dev->size;
+	struct scull_qset **pp = &dev->data;
+	char *small;
+	loff_t items;
+
+	if (size > scull_max_size)
+		return -EFBIG;
+	if (size < old) {
+		scull_punch(dev, size, old);
+		dev->size = size;
+		if (dev->small)
+			return 0;
+		items = div64_u64(size + itemsize - 1, itemsize);
+		for (; *pp && items; items--)
+			pp = &(*pp)->next;
+		scull_free_list(dev, *pp);
+		*pp = NULL;
+		if (dev->data || !size || size > SCULL_SMALL_MAX)
+			return 0;
+		old = dev->size = 0; /* all hole, but small: start over */
+	}
+	if (size == old)
+		return 0;
+	if (!dev->data && size <= SCULL_SMALL_MAX) {
+		/* small contents stay small, with the new bytes zeroed */
+		if (size > dev->smallroom) {
+			small = krealloc(dev->small, roundup_pow_of_two(size),
+					GFP_KERNEL);
+			if (!small)
+				return -ENOMEM;
+			dev->small = small;
+			dev->smallroom = roundup_pow_of_two(size);
+		}
+		memset(dev->small + old, 0, size - old);
+		dev->size = size;
+		return 0;
+	}
+	if (dev->small && scull_promote(dev))
+		return -ENOMEM;
+	dev->size = size;
+	scull_punch(dev, old, size); /* or the rest of the last quantum shows */
+	return 0;
+}
+
+/*
+ * Readers following the end of the device, like tail -f, can poll for
+ * it to grow past their position or ask for SIGIO; every write that
+ * adds data wakes them. Writes never block, so POLLOUT is always set.
+ */
+static void scull_notify(struct scull_dev *dev)
+{
+	if (wq_has_sleeper(&dev->inq))
+		wake_up_interruptible_poll(&dev->inq, POLLIN | POLLRDNORM);
+	kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+unsigned int scull_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_dev *dev = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(filp, &dev->inq, wait);
+	smp_mb(); /* check the size after we are on the queue */
+	if (READ_ONCE(filp->f_pos) < scull_size(dev))
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
+int scull_fasync(int fd, struct file *filp, int mode)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	return fasync_helper(fd, filp, mode, &dev->async_queue);
+}
+
+/*
+ * Data management: read and write
+ */
+
+/*
+ * The guts of read and write, for callers that already hold the
+ * device semaphore and keep their own position.
+ */
+ssize_t scull_read_locked(struct scull_dev *dev, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	int quantum = dev->quantum, qset = dev->qset;
+	ssize_t retval = 0;
+	loff_t size = scull_size(dev);
+	char *src;
+	int len;
+
+	if (dev->ring && *f_pos < scull_ring_oldest(dev, size))
+		*f_pos = scull_ring_oldest(dev, size); /* it was overwritten */
+	if (*f_pos >= size)
+		goto out;
+	if (*f_pos + count > size)
+		count = size - *f_pos;
+
+	if (dev->ring) {
+		src = scull_ring_at(dev, *f_pos, &len);
+		if (!src)
+			goto out;
+		if (count > len)
+			count = len;
+		if (copy_to_user(buf, src, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
+		*f_pos += count;
+		retval = count;
+		goto out;
+	}
+
+	if (dev->small) { /* small contents: all in one place */
+		if (copy_to_user(buf, dev->small + *f_pos, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
+		*f_pos += count;
+		retval = count;
+		goto out;
+	}
+
+	/* find the quantum, without allocating on the way */
+	src = scull_at(dev, &dev->data, quantum, qset, *f_pos, 0, &len);
+
+	/* read only up to the end of this quantum */
+	if (count > len)
+		count = len;
+
+	if (!src) {
+		/* a hole, left by a punch or a seek: it reads as zeroes */
+		if (clear_user(buf, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
+	} else if (copy_to_user(buf, src, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	*f_pos += count;
+	retval = count;
+
+  out:
+	return retval;
+}
+
+ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct scull_dev *dev = filp->private_data; 
+	ssize_t retval;
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	retval = scull_read_locked(dev, buf, count, f_pos);
+	mutex_unlock(&dev->lock);
+	return retval;
+}
+
+ssize_t scull_write_locked(struct scull_dev *dev, const char __user *buf,
+                size_t count, loff_t *f_pos)
+{
+	struct scull_qset *dptr;
+	int quantum = dev->quantum, qset = dev->qset;
+	int s_pos, q_pos;
+	loff_t item;
+	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+
+	if (dev->ring)
+		return scull_ring_write(dev, buf, count, f_pos);
+	if (*f_pos >= scull_max_size)
+		return -EFBIG;
+	if (count > scull_max_size - *f_pos)
+		count = scull_max_size - *f_pos;
+	if (!dev->data && *f_pos + count <= SCULL_SMALL_MAX &&
+			dev->size <= SCULL_SMALL_MAX)
+		return scull_small_write(dev, buf, count, f_pos);
+	if (dev->small && scull_promote(dev))
+		goto out;
+
+	/* find listitem, qset index and offset in the quantum */
+	scull_split(*f_pos, quantum, qset, &item, &s_pos, &q_pos);
+
+	/* follow the list up to the right position */
+	dptr = scull_follow(dev, item);
+	if (dptr == NULL)
+		goto out;
+	if (scull_qset_grow(dev, dptr, s_pos, qset))
+		goto out;
+	if (!dptr->data[s_pos]) {
+		dptr->data[s_pos] = scull_alloc(dev, quantum, GFP_KERNEL);
+		if (!dptr->data[s_pos])
+			goto out;
+	}
+	/* write only up to the end of this quantum */
+	if (count > quantum - q_pos)
+		count = quantum - q_pos;
+
+	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	*f_pos += count;
+	retval = count;
+
+        /* update the size */
+	if (dev->size < *f_pos)
+		dev->size = *f_pos;
+
+  out:
+	return retval;
+}
+
+ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct scull_dev *dev = filp->private_data;
+	ssize_t retval;
+
+  again:
+	retval = scull_log_write(dev, buf, count, f_pos);
+	if (retval > 0)
+		scull_notify(dev);
+	if (retval)
+		return retval;
+	if (scull_lock_data(dev, 1))
+		return -ERESTARTSYS;
+	if (rcu_access_pointer(dev->log)) { /* it started meanwhile */
+		mutex_unlock(&dev->lock);
+		goto again;
+	}
+	if (filp->f_flags & O_APPEND)
+		*f_pos = dev->size;
+	retval = scull_write_locked(dev, buf, count, f_pos);
+	mutex_unlock(&dev->lock);
+	if (retval > 0)
+		scull_notify(dev);
+	return retval;
+}
+
+static void scull_repack_work(struct work_struct *work)
+{
+	struct scull_repack *rp = container_of(work, struct scull_repack, work);
+	struct scull_dev *dev = rp->dev;
+	struct scull_cursor from = { &dev->data, 0 }, to = { &rp->data, 0 };
+	struct file *filp = rp->filp;
+	struct scull_qset *old;
+	int len, dlen;
+	char *src, *dst;
+	loff_t pos = 0;
+
+	mutex_lock(&dev->lock);
+	while (pos < dev->size) {
+		src = scull_at_from(dev, &from, dev->quantum, dev->qset,
+				pos, 0, &len);
+		dst = scull_at_from(dev, &to, rp->quantum, rp->qset,
+				pos, src != NULL, &dlen);
+		if (src && !dst)
+			break; /* out of memory: keep the old list */
+		len = min3((loff_t)len, (loff_t)dlen, dev->size - pos);
+		if (src)
+			memcpy(dst, src, len);
+		pos += len;
+		/* let the readers in */
+		mutex_unlock(&dev->lock);
+		cond_resched();
+		mutex_lock(&dev->lock);
+	}
+	if (pos >= dev->size) {
+		old = dev->data;
+		dev->data = rp->data;
+		dev->quantum = rp->quantum;
+		dev->qset = rp->qset;
+	} else {
+		printk(KERN_NOTICE "scull: no memory to repack a device\n");
+		old = rp->data;
+	}
+	mutex_unlock(&dev->lock);
+
+	/* before letting writers in: a trim would drop the counters */
+	scull_free_list(dev, old);
+	WRITE_ONCE(dev->repack, NULL);
+	wake_up_all(&scull_repack_wait);
+	kfree(rp);
+	fput(filp); /* the device may go now; scull_repack_wq is flushed first */
+}
+
+/*
+ * Give this device a geometry of its own (0 keeps the current value),
+ * which scull_trim() won't reset. If it holds data, that's repacked.
+ */
+static int scull_set_geometry(struct file *filp, struct scull_dev *dev,
+		int quantum, int qset)
+{
+	struct scull_repack *rp;
+
+	rp = kmalloc(sizeof(struct scull_repack), GFP_KERNEL);
+	if (!rp)
+		return -ENOMEM;
+	memset(rp, 0, sizeof(struct scull_repack));
+	if (mutex_lock_interruptible(&dev->lock)) {
+		kfree(rp);
+		return -ERESTARTSYS;
+	}
+	if (dev->repack || rcu_access_pointer(dev->log) || dev->ring) {
+		mutex_unlock(&dev->lock);
+		kfree(rp);
+		return -EBUSY;
+	}
+	rp->quantum = quantum ? quantum : dev->quantum;
+	rp->qset = qset ? qset : dev->qset;
+	dev->pinned = 1;
+	if (!dev->data || (rp->quantum == dev->quantum && rp->qset == dev->qset)) {
+		dev->quantum = rp->quantum; /* nothing to move */
+		dev->qset = rp->qset;
+		mutex_unlock(&dev->lock);
+		kfree(rp);
+		return 0;
+	}
+	rp->dev = dev;
+	rp->filp = get_file(filp);
+	INIT_WORK(&rp->work, scull_repack_work);
+	dev->repack = rp;
+	queue_work(scull_repack_wq, &rp->work);
+	mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/*
+ * SCULL_IOCBATCH: many reads and writes for one syscall and one
+ * acquisition of the semaphore, done in offset order so the list is
+ * walked the same way throughout. Each op is done in full, a quantum
+ * at a time, unless it hits an error or the end of the device.
+ */
+static int scull_batch_cmp(const void *a, const void *b)
+{
+	const struct scull_batch_op *x = *(const struct scull_batch_op **)a;
+	const struct scull_batch_op *y = *(const struct scull_batch_op **)b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return x < y ? -1 : x > y; /* same offset: as submitted */
+}
+
+static long scull_batch(struct scull_dev *dev, struct scull_batch __user *arg)
+{
+	struct scull_batch batch;
+	struct scull_batch_op *ops, **order;
+	struct scull_batch_op *op;
+	ssize_t result;
+	loff_t pos;
+	size_t done;
+	int i, wrote = 0;
+	long retval = 0;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count > SCULL_BATCH_MAX)
+		return -EINVAL;
+	ops = kmalloc_array(batch.count, sizeof(*ops), GFP_KERNEL);
+	order = kmalloc_array(batch.count, sizeof(*order), GFP_KERNEL);
+	if (!ops || !order) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(ops, u64_to_user_ptr(batch.ops),
+			batch.count * sizeof(*ops))) {
+		retval = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < batch.count; i++)
+		order[i] = ops + i;
+	sort(order, batch.count, sizeof(*order), scull_batch_cmp, NULL);
+
+	if (scull_lock_data(dev, 1)) {
+		retval = -ERESTARTSYS;
+		goto out;
+	}
+	if (rcu_access_pointer(dev->log)) { /* its writers don't lock */
+		mutex_unlock(&dev->lock);
+		retval = -EBUSY;
+		goto out;
+	}
+	for (i = 0; i < batch.count; i++) {
+		op = order[i];
+		if (op->offset > LLONG_MAX ||
+				(op->op != SCULL_BATCH_READ && op->op != SCULL_BATCH_WRITE)) {
+			op->result = -EINVAL;
+			continue;
+		}
+		pos = op->offset;
+		for (done = 0, result = 0; done < op->len; done += result) {
+			if (fatal_signal_pending(current)) { /* a batch can be long */
+				retval = -EINTR;
+				break;
+			}
+			cond_resched();
+			if (op->op == SCULL_BATCH_READ)
+				result = scull_read_locked(dev,
+						u64_to_user_ptr(op->buf + done),
+						op->len - done, &pos);
+			else
+				result = scull_write_locked(dev,
+						u64_to_user_ptr(op->buf + done),
+						op->len - done, &pos);
+			if (result <= 0)
+				break;
+		}
+		op->result = done ? done : result;
+		if (op->op == SCULL_BATCH_WRITE && done)
+			wrote = 1;
+		if (retval)
+			break;
+	}
+	mutex_unlock(&dev->lock);
+	if (wrote)
+		scull_notify(dev);
+
+	if (copy_to_user(u64_to_user_ptr(batch.ops), ops,
+			batch.count * sizeof(*ops)))
+		retval = -EFAULT;
+  out:
+	kfree(order);
+	kfree(ops);
+	return retval;
+}
+
 /*
- * Here are our sequence iteration methods.  Our "position" is
- * simply the device number.
+ * SCULL_IOCMAP, like FIEMAP: which ranges of the device have memory
+ * behind them. Neighbouring quanta make one extent; the geometry goes
+ * back with the map, for the quantum boundaries.
  */
-static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+static int scull_map_put(struct scull_map *map, struct scull_extent *ext,
+		struct scull_extent __user *uext)
 {
-	if (*pos >= scull_nr_devs)
-		return NULL;   /* No more to read */
-	return scull_devices + *pos;
+	if (map->room && copy_to_user(uext + map->mapped, ext, sizeof(*ext)))
+		return -EFAULT;
+	map->mapped++;
+	return 0;
 }
 
-static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
+/* 1 once the array is full, so the walk can stop */
+static int scull_map_add(struct scull_map *map, struct scull_extent *ext,
+		struct scull_extent __user *uext, loff_t from, loff_t to)
 {
-	(*pos)++;
-	if (*pos >= scull_nr_devs)
-		return NULL;
-	return scull_devices + *pos;
-}
+	int err;
 
-static void scull_seq_stop(struct seq_file *s, void *v)
-{
-	/* Actually, there's nothing to do here */
+	if (from >= to)
+		return 0;
+	if (ext->length && ext->offset + ext->length == from) {
+		ext->length += to - from;
+		return 0;
+	}
+	if (ext->length) {
+		err = scull_map_put(map, ext, uext);
+		if (err)
+			return err;
+	}
+	if (map->room && map->mapped == map->room)
+		return 1;
+	ext->offset = from;
+	ext->length = to - from;
+	return 0;
 }
 
-static int scull_seq_show(struct seq_file *s, void *v)
+static long scull_map(struct scull_dev *dev, struct scull_map __user *arg)
 {
-	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
-	int i;
+	struct scull_map map;
+	struct scull_extent ext;
+	struct scull_extent __user *uext;
+	struct scull_qset *dptr;
+	loff_t size, start, end, base, qstart, itemsize;
+	int i, more = 0, err = 0;
+
+	if (copy_from_user(&map, arg, sizeof(map)))
+		return -EFAULT;
+	if (map.start > LLONG_MAX)
+		return -EINVAL;
+	uext = u64_to_user_ptr(map.extents);
+	memset(&ext, 0, sizeof(ext));
+	map.mapped = 0;
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
-	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-			(int) (dev - scull_devices), dev->qset,
-			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
+	size = scull_size(dev);
+	start = map.start;
+	if (start >= size)
+		end = start; /* nothing there */
+	else
+		end = map.length > size - start ? size : start + map.length;
+	map.quantum = dev->quantum;
+	map.qset = dev->qset;
+	itemsize = (loff_t)dev->quantum * dev->qset;
+
+	if (dev->small) { /* all of it, in one place */
+		err = scull_map_add(&map, &ext, uext, start, end);
+		more = end < size;
+	} else if (dev->ring) { /* all there, from the oldest byte */
+		err = scull_map_add(&map, &ext, uext,
+				max(start, scull_ring_oldest(dev, size)), end);
+		more = end < size;
+	} else { /* going on past the range, for a quantum after it */
+		for (dptr = dev->data, base = 0; dptr && base < size && !err && !more;
+				dptr = dptr->next, base += itemsize) {
+			if (base + itemsize <= start)
+				continue;
+			for (i = 0; i < dptr->nr && !err; i++) {
+				if (!dptr->data[i])
+					continue;
+				qstart = base + (loff_t)i * dev->quantum;
+				if (qstart >= end) {
+					more = qstart < size;
+					break;
+				}
+				err = scull_map_add(&map, &ext, uext, max(start, qstart),
+						min(end, qstart + dev->quantum));
 			}
+		}
+	}
+	if (!err && ext.length) { /* the walk went to the end of the range */
+		if (!more) /* and of the device's quanta */
+			ext.flags |= SCULL_EXTENT_LAST;
+		err = scull_map_put(&map, &ext, uext);
 	}
 	mutex_unlock(&dev->lock);
+
+	if (err < 0)
+		return err;
+	if (copy_to_user(arg, &map, sizeof(map)))
+		return -EFAULT;
 	return 0;
 }
-	
-/*
- * Tie the sequence operators up.
- */
-static struct seq_operations scull_seq_ops = {
-	.start = scull_seq_start,
-	.next  = scull_seq_next,
-	.stop  = scull_seq_stop,
-	.show  = scull_seq_show
-};
 
 /*
- * Now to implement the /proc files we need only make an open
- * method which sets up the sequence operators.
+ * Go over [from, to) of the device in place, calling "fn" for each
+ * piece: a run within one quantum, or NULL for a hole, which reads as
+ * zeroes; past the list, a hole comes a list item's worth at a time.
+ * Every SCULL_WALK_PAUSE quanta and every list item, it reschedules.
+ * Stops early if fn returns nonzero, and returns that, or -EINTR if
+ * the caller is killed. Called with the device semaphore held, "to" no
+ * further than the end.
  */
-static int scullmem_proc_open(struct inode *inode, struct file *file)
+typedef int (*scull_walk_fn)(void *arg, const char *data, size_t len);
+
+/* between pieces: a walk can take a while */
+#define SCULL_WALK_PAUSE 64	/* quanta in a list item between pauses */
+
+static int scull_walk_pause(void)
 {
-	return single_open(file, scull_read_procmem, NULL);
+	if (fatal_signal_pending(current))
+		return -EINTR;
+	cond_resched();
+	return 0;
 }
 
-static int scullseq_proc_open(struct inode *inode, struct file *file)
+static int scull_walk(struct scull_dev *dev, loff_t from, loff_t to,
+		scull_walk_fn fn, void *arg)
 {
-	return seq_open(file, &scull_seq_ops);
+	loff_t itemsize = (loff_t)dev->quantum * dev->qset;
+	loff_t base, qstart, start, end;
+	struct scull_qset *dptr;
+	const char *src;
+	unsigned int pieces = 0;
+	int i, len, ret;
+
+	if (from >= to)
+		return 0;
+	if (dev->small)
+		return fn(arg, dev->small + from, to - from);
+	if (dev->ring) {
+		for (; from < to; from += len) {
+			src = scull_ring_at(dev, from, &len);
+			len = min_t(loff_t, len, to - from);
+			ret = fn(arg, src, len);
+			if (!ret)
+				ret = scull_walk_pause();
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+	for (dptr = dev->data, base = 0; dptr && base < to;
+			dptr = dptr->next, base += itemsize) {
+		if (base + itemsize <= from)
+			continue;
+		i = from > base ? div64_u64(from - base, dev->quantum) : 0;
+		for (; i < dev->qset; i++) {
+			qstart = base + (loff_t)i * dev->quantum;
+			if (qstart >= to)
+				break;
+			start = max(from, qstart);
+			end = min(to, qstart + dev->quantum);
+			src = i < dptr->nr && dptr->data[i] ?
+					(char *)dptr->data[i] + (start - qstart) : NULL;
+			ret = fn(arg, src, end - start);
+			if (!ret && !(++pieces % SCULL_WALK_PAUSE)) /* a big qset */
+				ret = scull_walk_pause();
+			if (ret)
+				return ret;
+		}
+		ret = scull_walk_pause();
+		if (ret)
+			return ret;
+	}
+	for (start = max(from, base); start < to; start = end) { /* past the list */
+		end = min(to, start + itemsize);
+		ret = fn(arg, NULL, end - start);
+		if (!ret)
+			ret = scull_walk_pause();
+		if (ret)
+			return ret;
+	}
+	return 0;
 }
 
 /*
- * Create a set of file operations for our proc files.
+ * SCULL_IOCSUM: a checksum of a range, without copying it out.
  */
-static struct file_operations scullmem_proc_ops = {
-	.owner   = THIS_MODULE,
-	.open    = scullmem_proc_open,
-	.read    = seq_read,
-	.llseek  = seq_lseek,
-	.release = single_release
-};
+static const char scull_zeros[512]; /* what holes are made of */
 
-static struct file_operations scullseq_proc_ops = {
-	.owner   = THIS_MODULE,
-	.open    = scullseq_proc_open,
-	.read    = seq_read,
-	.llseek  = seq_lseek,
-	.release = seq_release
+struct scull_sum_state {
+	int algo;
+	u32 crc;
+	struct xxh64_state xxh;
 };
-	
+
+static int scull_sum_fn(void *arg, const char *data, size_t len)
+{
+	struct scull_sum_state *st = arg;
+	size_t n;
+
+	for (; len; len -= n, data = data ? data + n : NULL) {
+		n = data ? len : min(len, sizeof(scull_zeros));
+		if (st->algo == SCULL_SUM_CRC32C)
+			st->crc = crc32c(st->crc, data ? data : scull_zeros, n);
+		else
+			xxh64_update(&st->xxh, data ? data : scull_zeros, n);
+	}
+	return 0;
+}
 
 /*
- * Actually create (and remove) the /proc file(s).
+ * SCULL_IOCFIND: the first place a pattern shows up in a range. The
+ * pattern can straddle pieces, so the last patlen - 1 bytes seen are
+ * kept in "tail" and searched together with the start of each piece.
  */
+struct scull_find_state {
+	const u8 *pat;
+	int patlen;
+	loff_t pos;			/* where the piece starts */
+	u8 tail[SCULL_FIND_MAX - 1];
+	int taillen;
+	u8 seam[2 * SCULL_FIND_MAX];
+	loff_t found;
+};
 
-static void scull_create_proc(void)
+/* the first match starting before "limit" in buf, or -1 */
+static long scull_find_in(const u8 *buf, size_t len, size_t limit,
+		const u8 *pat, int patlen)
 {
-	proc_create_data("scullmem", 0 /* default mode */,
-			NULL /* parent dir */, proc_ops_wrapper(&scullmem_proc_ops, scullmem_pops),
-			NULL /* client data */);
-	proc_create("scullseq", 0, NULL, proc_ops_wrapper(&scullseq_proc_ops, scullseq_pops));
+	const u8 *p = buf, *end;
+
+	if (len < patlen)
+		return -1;
+	end = buf + min(limit, len - patlen + 1);
+	while (p < end && (p = memchr(p, pat[0], end - p))) {
+		if (!memcmp(p, pat, patlen))
+			return p - buf;
+		p++;
+	}
+	return -1;
 }
 
-static void scull_remove_proc(void)
+static int scull_find_fn(void *arg, const char *data, size_t len)
 {
-	/* no problem if it was not registered */
-	remove_proc_entry("scullmem", NULL /* parent dir */);
-	remove_proc_entry("scullseq", NULL);
-}
-
-
-#endif /* SCULL_DEBUG */
-
-
+	struct scull_find_state *st = arg;
+	const u8 *pat = st->pat;
+	int keep = st->patlen - 1, head = min_t(size_t, len, keep);
+	long at;
+	int i;
 
+	/* matches that start in the tail and run into this piece */
+	memcpy(st->seam, st->tail, st->taillen);
+	if (data)
+		memcpy(st->seam + st->taillen, data, head);
+	else
+		memset(st->seam + st->taillen, 0, head);
+	at = scull_find_in(st->seam, st->taillen + head, st->taillen,
+			pat, st->patlen);
+	if (at >= 0) {
+		st->found = st->pos - st->taillen + at;
+		return 1;
+	}
 
+	/* then those within it */
+	if (data) {
+		at = scull_find_in((const u8 *)data, len, len, pat, st->patlen);
+	} else { /* only zeroes here */
+		for (i = 0; i < st->patlen && !pat[i]; i++)
+			;
+		at = i == st->patlen && len >= st->patlen ? 0 : -1;
+	}
+	if (at >= 0) {
+		st->found = st->pos + at;
+		return 1;
+	}
 
-/*
- * Open and close
- */
+	/* keep what the next match could start in */
+	if (len >= keep) {
+		if (data)
+			memcpy(st->tail, data + len - keep, keep);
+		else
+			memset(st->tail, 0, keep);
+		st->taillen = keep;
+	} else { /* the seam holds all of tail and piece */
+		i = max(st->taillen + (int)len - keep, 0);
+		st->taillen += len - i;
+		memcpy(st->tail, st->seam + i, st->taillen);
+	}
+	st->pos += len;
+	return 0;
+}
 
-int scull_open(struct inode *inode, struct file *filp)
+/* clip [offset, offset + length) to the device */
+static void scull_range_clip(struct scull_dev *dev, u64 offset, u64 length,
+		loff_t *from, loff_t *to)
 {
-	struct scull_dev *dev; /* device information */
-
-	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-	filp->private_data = dev; /* for other methods */
+	loff_t size = scull_size(dev);
 
-	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->lock))
-			return -ERESTARTSYS;
-		scull_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->lock);
+	if (offset >= size) {
+		*from = *to = size;
+		return;
 	}
-	return 0;          /* success */
+	*from = offset;
+	*to = length > size - offset ? size : offset + length;
+	if (dev->ring)
+		*from = max(*from, scull_ring_oldest(dev, size));
 }
 
-int scull_release(struct inode *inode, struct file *filp)
+static long scull_sum(struct scull_dev *dev, struct scull_sum __user *arg)
 {
+	struct scull_sum sum;
+	struct scull_sum_state *st;
+	loff_t from, to;
+	int err;
+
+	if (copy_from_user(&sum, arg, sizeof(sum)))
+		return -EFAULT;
+	if (sum.algo != SCULL_SUM_CRC32C && sum.algo != SCULL_SUM_XXH64)
+		return -EINVAL;
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	st->algo = sum.algo;
+	st->crc = ~(u32)sum.seed;
+	xxh64_reset(&st->xxh, sum.seed);
+
+	if (mutex_lock_interruptible(&dev->lock)) {
+		kfree(st);
+		return -ERESTARTSYS;
+	}
+	scull_range_clip(dev, sum.offset, sum.length, &from, &to);
+	err = scull_walk(dev, from, to, scull_sum_fn, st);
+	mutex_unlock(&dev->lock);
+	if (err) {
+		kfree(st);
+		return err;
+	}
+
+	sum.length = to - from;
+	sum.sum = sum.algo == SCULL_SUM_CRC32C ? ~st->crc : xxh64_digest(&st->xxh);
+	kfree(st);
+	if (copy_to_user(arg, &sum, sizeof(sum)))
+		return -EFAULT;
 	return 0;
 }
-/*
- * Follow the list
- */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
-{
-	struct scull_qset *qs = dev->data;
 
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
-			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
+static long scull_find(struct scull_dev *dev, struct scull_find __user *arg)
+{
+	struct scull_find find;
+	struct scull_find_state *st;
+	loff_t from, to;
+	u8 *pat;
+	int err;
+
+	if (copy_from_user(&find, arg, sizeof(find)))
+		return -EFAULT;
+	if (find.patlen < 1 || find.patlen > SCULL_FIND_MAX)
+		return -EINVAL;
+	pat = memdup_user(u64_to_user_ptr(find.pattern), find.patlen);
+	if (IS_ERR(pat))
+		return PTR_ERR(pat);
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st) {
+		kfree(pat);
+		return -ENOMEM;
 	}
+	st->pat = pat;
+	st->patlen = find.patlen;
+	st->found = -1;
 
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
-		}
-		qs = qs->next;
-		continue;
+	if (mutex_lock_interruptible(&dev->lock)) {
+		kfree(st);
+		kfree(pat);
+		return -ERESTARTSYS;
 	}
-	return qs;
+	scull_range_clip(dev, find.offset, find.length, &from, &to);
+	st->pos = from;
+	err = scull_walk(dev, from, to, scull_find_fn, st);
+	mutex_unlock(&dev->lock);
+	if (err < 0) {
+		kfree(st);
+		kfree(pat);
+		return err;
+	}
+
+	find.found = st->found;
+	kfree(st);
+	kfree(pat);
+	if (copy_to_user(arg, &find, sizeof(find)))
+		return -EFAULT;
+	return 0;
 }
 
 /*
- * Data management: read and write
+ * SEEK_DATA and SEEK_HOLE: the first piece at or after "off" that is
+ * (or isn't) backed by a quantum. The end of the device is a hole, and
+ * a recorder's data starts at its oldest byte.
  */
+struct scull_seek_state {
+	int hole;
+	loff_t pos;
+};
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static int scull_seek_fn(void *arg, const char *data, size_t len)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
-
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
-
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*f_pos += count;
-	retval = count;
+	struct scull_seek_state *st = arg;
 
-  out:
-	mutex_unlock(&dev->lock);
-	return retval;
+	if ((data == NULL) == st->hole)
+		return 1;
+	st->pos += len;
+	return 0;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t off, int hole)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+	struct scull_seek_state st = { .hole = hole };
+	loff_t from, to;
+	int found;
 
+	if (off < 0)
+		return -ENXIO;
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
+	to = scull_size(dev);
+	if (off >= to) {
+		mutex_unlock(&dev->lock);
+		return -ENXIO;
 	}
-	*f_pos += count;
-	retval = count;
-
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-
-  out:
+	scull_range_clip(dev, off, to - off, &from, &to);
+	st.pos = from;
+	found = scull_walk(dev, from, to, scull_seek_fn, &st);
 	mutex_unlock(&dev->lock);
-	return retval;
+
+	if (found < 0)
+		return found;
+	if (found > 0)
+		return st.pos;
+	return hole ? to : -ENXIO;
 }
 
 /*
@@ -396,6 +2049,13 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	/* the pipes come here too, but they have no scull_dev */
+	struct scull_dev *dev = filp->f_op == &scull_pipe_fops ?
+			NULL : filp->private_data;
+	struct scull_geometry geom;
+	struct scull_range range;
+	struct scull_numa numa;
+	__u64 size;
 	int err = 0, tmp;
 	int retval = 0;
     
@@ -508,6 +2168,139 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	/*
+	 * Per-device geometry: takes effect on this device right away.
+	 */
+	  case SCULL_IOCSGEOMETRY:
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&geom, (void __user *)arg, sizeof(geom)))
+			return -EFAULT;
+		if (geom.quantum > SCULL_QUANTUM_MAX || geom.qset > SCULL_QSET_MAX)
+			return -EINVAL;
+		return scull_set_geometry(filp, dev, geom.quantum, geom.qset);
+
+	  case SCULL_IOCGGEOMETRY:
+		if (!dev)
+			return -ENOTTY;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		geom.quantum = dev->quantum;
+		geom.qset = dev->qset;
+		geom.repacking = dev->repack != NULL;
+		mutex_unlock(&dev->lock);
+		if (copy_to_user((void __user *)arg, &geom, sizeof(geom)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCTLOG: /* arg is 1 to start log mode, 0 to stop it */
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (scull_lock_data(dev, 1))
+			return -ERESTARTSYS;
+		if (arg)
+			retval = scull_log_start(dev);
+		else
+			scull_log_stop(dev);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCQLOG:
+		if (!dev)
+			return -ENOTTY;
+		return rcu_access_pointer(dev->log) != NULL;
+
+	  case SCULL_IOCSRING: /* arg points to the size, 0 to stop */
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&size, (void __user *)arg, sizeof(size)))
+			return -EFAULT;
+		if (scull_lock_data(dev, 1))
+			return -ERESTARTSYS;
+		retval = scull_ring_start(dev, size);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCPUNCH:
+	  case SCULL_IOCSSIZE:
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *)arg, _IOC_SIZE(cmd)))
+			return -EFAULT;
+		if (scull_lock_data(dev, 1))
+			return -ERESTARTSYS;
+		if (rcu_access_pointer(dev->log) || dev->ring)
+			retval = -EBUSY;
+		else if (cmd == SCULL_IOCSSIZE) /* arg points to just a size */
+			retval = scull_set_size(dev, min_t(u64, range.offset, LLONG_MAX));
+		else if (range.offset < LLONG_MAX)
+			scull_punch(dev, range.offset,
+					range.length > LLONG_MAX - range.offset ?
+					LLONG_MAX : range.offset + range.length);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCSUM:
+		if (!dev)
+			return -ENOTTY;
+		return scull_sum(dev, (struct scull_sum __user *)arg);
+
+	  case SCULL_IOCFIND:
+		if (!dev)
+			return -ENOTTY;
+		return scull_find(dev, (struct scull_find __user *)arg);
+
+	  case SCULL_IOCMAP:
+		if (!dev)
+			return -ENOTTY;
+		return scull_map(dev, (struct scull_map __user *)arg);
+
+	  case SCULL_IOCBATCH:
+		if (!dev)
+			return -ENOTTY;
+		return scull_batch(dev, (struct scull_batch __user *)arg);
+
+	  case SCULL_IOCGRING:
+		if (!dev)
+			return -ENOTTY;
+		size = READ_ONCE(dev->ring);
+		if (copy_to_user((void __user *)arg, &size, sizeof(size)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCSNUMA: /* the pipes have their own */
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		retval = scull_place_set(&dev->place, &numa);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCGNUMA:
+		if (!dev)
+			return -ENOTTY;
+		memset(&numa, 0, sizeof(numa));
+		if (mutex_lock_interruptible(&dev->lock)) /* against a trim */
+			return -ERESTARTSYS;
+		scull_place_get(&dev->place, &numa);
+		mutex_unlock(&dev->lock);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -537,13 +2330,21 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		break;
 
 	  case 2: /* SEEK_END */
-		newpos = dev->size + off;
+		newpos = scull_size(dev) + off;
+		break;
+
+	  case SEEK_DATA:
+	  case SEEK_HOLE:
+		newpos = scull_seek_data(dev, off, whence == SEEK_HOLE);
+		if (newpos < 0)
+			return newpos;
 		break;
 
 	  default: /* can't happen */
 		return -EINVAL;
 	}
 	if (newpos < 0) return -EINVAL;
+	if (newpos > scull_max_size && !READ_ONCE(dev->ring)) return -EINVAL;
 	filp->f_pos = newpos;
 	return newpos;
 }
@@ -556,6 +2357,8 @@ struct file_operations scull_fops = {
 	.read =     scull_read,
 	.write =    scull_write,
 	.unlocked_ioctl = scull_ioctl,
+	.poll =     scull_poll,
+	.fasync =   scull_fasync,
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -574,6 +2377,11 @@ void scull_cleanup_module(void)
 	int i;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* a repack may still be on its way out, past its last fput() */
+	if (scull_repack_wq)
+		destroy_workqueue(scull_repack_wq);
+	scull_repack_wq = NULL;
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
@@ -593,6 +2401,7 @@ void scull_cleanup_module(void)
 	/* and call the cleanup functions for friend devices */
 	scull_p_cleanup();
 	scull_access_cleanup();
+	scull_ctl_cleanup();
 
 }
 
@@ -635,6 +2444,12 @@ int scull_init_module(void)
 		return result;
 	}
 
+	scull_repack_wq = alloc_workqueue("scull_repack", 0, 0);
+	if (!scull_repack_wq) {
+		result = -ENOMEM;
+		goto fail;
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -651,6 +2466,7 @@ int scull_init_module(void)
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
 		mutex_init(&scull_devices[i].lock);
+		init_waitqueue_head(&scull_devices[i].inq);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
@@ -658,6 +2474,9 @@ int scull_init_module(void)
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);
+	result = scull_ctl_init(); /* in a region of its own */
+	if (result)
+		goto fail;
 
 #ifdef SCULL_DEBUG /* only when debugging */
 	scull_create_proc();
@@ -19,6 +19,9 @@
 
 #include <linux/kernel.h>	/* printk(), min() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/mm.h>		/* remap_vmalloc_range() */
+#include <linux/topology.h>	/* cpu_to_node() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/proc_fs.h>
 #include <linux/errno.h>	/* error codes */
@@ -29,6 +32,7 @@
 #include <asm/uaccess.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
+#include <linux/sched/clock.h>	/* local_clock() */
 #include <linux/seq_file.h>
 
 #include "proc_ops_version.h"
@@ -39,25 +43,620 @@ struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
         char *buffer, *end;                /* begin of buf, end of buf */
         int buffersize;                    /* used in pointer arithmetic */
+        int size;                          /* buffer size to use, 0: scull_p_buffer */
         char *rp, *wp;                     /* where to read, where to write */
         int nreaders, nwriters;            /* number of openings for r/w */
+        int mode;                          /* SCULL_P_FIFO, _BCAST, ... */
+        struct scull_p_ring *ring;         /* ring mode: the mapped header */
+        atomic_t nmaps;                    /* ring mode: mappings of it */
+        struct mutex map_lock;             /* mmap against mode changes */
+        int drop;                          /* bcast: drop slow readers, don't block */
+        int rlowat, wlowat;                /* bytes queued/free before waking */
+        int hiwat;                         /* most bytes queued, 0: all that fits */
+        atomic_t rshort, wshort;           /* sleepers wanting less than that */
+        struct scull_dev spill;            /* elastic: what didn't fit */
+        loff_t spill_pos;                  /* elastic: where to read it */
+        long spilled, spill_cap;           /* elastic: bytes in it, limit */
+        struct scull_p_queue *lanes;       /* lanes mode: lanes[1] and up */
+        struct scull_p_shard *shards;      /* sharded mode: nr_shards of them */
+        int nr_shards, rshard;             /* and the one to merge from next */
+        unsigned int wshard;               /* the next writer's shard */
+        struct scull_p_stats stats;        /* see scull.h */
+        struct scull_place place;          /* NUMA policy and usage of the buffers */
+        struct list_head readers;          /* the scull_p_file of each reader */
         struct fasync_struct *async_queue; /* asynchronous readers */
         struct mutex lock;              /* mutual exclusion mutex */
         struct cdev cdev;                  /* Char device structure */
 };
 
+/* A plain circular queue, for the lanes above 0 and the shards */
+struct scull_p_queue {
+        char *buffer, *end;
+        int size;
+        char *rp, *wp;
+};
+
+/* Sharded mode: a queue and a lock for some of the writers */
+struct scull_p_shard {
+        struct mutex lock;
+        struct scull_p_queue q;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Per-open state. In broadcast mode every reader has its own read
+ * pointer into the shared buffer, and dev->rp is simply the one of
+ * the slowest reader: that's what the writer must not overrun.
+ */
+struct scull_p_file {
+        struct scull_pipe *dev;
+        char *rp;                          /* bcast: where this reader reads */
+        int overrun;                       /* bcast: the writer dropped us */
+        int busy_poll;                     /* usecs to spin before sleeping */
+        int lane;                          /* lanes mode: where we write */
+        unsigned int shard;                /* sharded mode: where we write */
+        struct list_head list;             /* entry in dev->readers */
+};
+
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_busy_poll;		/* default busy-poll budget, usecs */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_busy_poll, int, 0);
 
 static struct scull_pipe *scull_p_devices;
 
+/* How much the buffer may hold: the high watermark, or all that fits */
+static int scull_p_hiwat(struct scull_pipe *dev)
+{
+	int hiwat = READ_ONCE(dev->hiwat);
+
+	return hiwat && hiwat < dev->buffersize - 1 ? hiwat : dev->buffersize - 1;
+}
+
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
+static void scull_p_wake_in(struct scull_pipe *dev);
+
+/*
+ * Buffer management. In ring mode the buffer is vmalloc'ed behind a
+ * header page, and both are mapped by user space; the header's head
+ * and tail are then the real write and read pointers. We copy them
+ * into wp and rp whenever we take the mutex, and store back the one
+ * we moved. User space and the kernel can each be producer or
+ * consumer, but there is only one of each, as with any ring.
+ */
+static int scull_p_alloc(struct scull_pipe *dev, int mode, int writer)
+{
+	struct scull_p_ring *ring = NULL;
+	int size = dev->size ? dev->size : scull_p_buffer;
+	char *buffer;
+
+	if (mode == SCULL_P_RING) {
+		size = PAGE_ALIGN(size);
+		ring = vmalloc_user(PAGE_SIZE + size); /* zeroed */
+		if (!ring)
+			return -ENOMEM;
+		ring->size = size;
+		ring->data = PAGE_SIZE;
+		buffer = (char *)ring + PAGE_SIZE;
+	} else {
+		buffer = scull_place_alloc(&dev->place, size, GFP_KERNEL,
+				scull_place_node(&dev->place, writer));
+		if (!buffer)
+			return -ENOMEM;
+	}
+	dev->ring = ring;
+	dev->buffer = buffer;
+	dev->buffersize = size;
+	dev->end = dev->buffer + dev->buffersize;
+	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
+	/* the size may have shrunk under the watermarks */
+	dev->rlowat = clamp(dev->rlowat, 1, max(scull_p_hiwat(dev) - 1, 1));
+	dev->wlowat = clamp(dev->wlowat, 1, max(scull_p_hiwat(dev) - dev->rlowat, 1));
+	return 0;
+}
+
+static void scull_p_free(struct scull_pipe *dev, struct scull_p_ring *ring,
+		char *buffer)
+{
+	if (ring)
+		vfree(ring);
+	else
+		scull_place_free(&dev->place, buffer);
+}
+
+static int scull_p_queue_init(struct scull_pipe *dev, struct scull_p_queue *q,
+		int size, int node)
+{
+	q->buffer = scull_place_alloc(&dev->place, size, GFP_KERNEL, node);
+	if (!q->buffer)
+		return -ENOMEM;
+	q->size = size;
+	q->end = q->buffer + size;
+	q->rp = q->wp = q->buffer;
+	return 0;
+}
+
+/*
+ * Lanes mode: lane 0 is the buffer itself, the higher lanes are queues
+ * on the side. They are allocated on the way into lanes mode and only
+ * freed on the last close, so poll() and the sleep checks can look at
+ * them without the mutex; everything else needs it. The shards of
+ * sharded mode are managed the same way.
+ */
+static void scull_p_free_lanes(struct scull_pipe *dev)
+{
+	int lane;
+
+	if (!dev->lanes)
+		return;
+	for (lane = 1; lane < SCULL_P_NR_LANES; lane++)
+		scull_place_free(&dev->place, dev->lanes[lane].buffer);
+	kfree(dev->lanes);
+	dev->lanes = NULL;
+}
+
+static int scull_p_alloc_lanes(struct scull_pipe *dev, int writer)
+{
+	struct scull_p_queue *lanes;
+	int lane;
+
+	lanes = kzalloc(SCULL_P_NR_LANES * sizeof(*lanes), GFP_KERNEL);
+	if (!lanes)
+		return -ENOMEM;
+	for (lane = 1; lane < SCULL_P_NR_LANES; lane++)
+		if (scull_p_queue_init(dev, &lanes[lane], dev->buffersize,
+				scull_place_node(&dev->place, writer)))
+			goto nomem;
+	smp_store_release(&dev->lanes, lanes); /* for the lockless checks */
+	return 0;
+
+  nomem:
+	while (--lane > 0)
+		scull_place_free(&dev->place, lanes[lane].buffer);
+	kfree(lanes);
+	return -ENOMEM;
+}
+
+static void scull_p_free_shards(struct scull_pipe *dev)
+{
+	int i;
+
+	if (!dev->shards)
+		return;
+	for (i = 0; i < dev->nr_shards; i++)
+		scull_place_free(&dev->place, dev->shards[i].q.buffer);
+	kfree(dev->shards);
+	dev->shards = NULL;
+}
+
+static int scull_p_alloc_shards(struct scull_pipe *dev, int writer)
+{
+	struct scull_p_shard *shards;
+	int i, n = nr_cpu_ids, node;
+
+	shards = kcalloc(n, sizeof(*shards), GFP_KERNEL);
+	if (!shards)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		mutex_init(&shards[i].lock);
+		/* left to the allocator, a shard goes near its cpu */
+		node = scull_place_node(&dev->place, writer);
+		if (node == NUMA_NO_NODE)
+			node = cpu_to_node(i);
+		if (scull_p_queue_init(dev, &shards[i].q, dev->buffersize, node))
+			goto nomem;
+	}
+	dev->nr_shards = n;
+	dev->rshard = 0;
+	smp_store_release(&dev->shards, shards);
+	return 0;
+
+  nomem:
+	while (--i >= 0)
+		scull_place_free(&dev->place, shards[i].q.buffer);
+	kfree(shards);
+	return -ENOMEM;
+}
+
+static int scull_p_queued(struct scull_p_queue *q)
+{
+	return (READ_ONCE(q->wp) - READ_ONCE(q->rp) + q->size) % q->size;
+}
+
+static int scull_p_queue_room(struct scull_p_queue *q)
+{
+	return q->size - 1 - scull_p_queued(q);
+}
+
+/* Which lanes above 0 have data, as a bitmask */
+static int scull_p_lanes_mask(struct scull_pipe *dev)
+{
+	struct scull_p_queue *lanes = smp_load_acquire(&dev->lanes);
+	int lane, mask = 0;
+
+	if (!lanes || READ_ONCE(dev->mode) != SCULL_P_LANES)
+		return 0;
+	for (lane = 1; lane < SCULL_P_NR_LANES; lane++)
+		if (scull_p_queued(&lanes[lane]))
+			mask |= 1 << lane;
+	return mask;
+}
+
+static ssize_t scull_p_queue_read(struct scull_p_queue *q, char __user *buf,
+		size_t count)
+{
+	if (q->wp > q->rp)
+		count = min(count, (size_t)(q->wp - q->rp));
+	else /* wrapped, return data up to the end */
+		count = min(count, (size_t)(q->end - q->rp));
+	if (copy_to_user(buf, q->rp, count))
+		return -EFAULT;
+	WRITE_ONCE(q->rp, q->rp + count == q->end ? q->buffer : q->rp + count);
+	return count;
+}
+
+static ssize_t scull_p_queue_write(struct scull_p_queue *q,
+		const char __user *buf, size_t count)
+{
+	count = min(count, (size_t)scull_p_queue_room(q));
+	if (q->wp >= q->rp)
+		count = min(count, (size_t)(q->end - q->wp));
+	else /* wrapped, fill up to rp-1 */
+		count = min(count, (size_t)(q->rp - q->wp - 1));
+	if (copy_from_user(q->wp, buf, count))
+		return -EFAULT;
+	WRITE_ONCE(q->wp, q->wp + count == q->end ? q->buffer : q->wp + count);
+	return count;
+}
+
+/*
+ * Sharded mode: each writer has a shard, picked round robin as it
+ * opens (nr_cpu_ids of them, so that there are enough for one writer
+ * per CPU), and takes only that shard's lock, never the pipe mutex; a
+ * writer that migrates keeps its shard, so its data stays in order.
+ * The reader merges the shards into its buffer in turn, draining each
+ * before it moves on. Nothing is promised about how the data of
+ * different writers is interleaved.
+ */
+static long scull_p_shards_queued(struct scull_pipe *dev)
+{
+	struct scull_p_shard *shards = smp_load_acquire(&dev->shards);
+	long queued = 0;
+	int i;
+
+	if (!shards || READ_ONCE(dev->mode) != SCULL_P_SHARD)
+		return 0;
+	for (i = 0; i < dev->nr_shards; i++)
+		queued += scull_p_queued(&shards[i].q);
+	return queued;
+}
+
+/* With the pipe mutex held: this is the only reader */
+static ssize_t scull_p_shard_read(struct scull_pipe *dev, char __user *buf,
+		size_t count)
+{
+	struct scull_p_shard *sh;
+	ssize_t result, done = 0;
+	int i;
+
+	for (i = 0; i < dev->nr_shards && done < count; i++) {
+		sh = &dev->shards[dev->rshard];
+		mutex_lock(&sh->lock);
+		while (done < count && scull_p_queued(&sh->q)) { /* may wrap */
+			result = scull_p_queue_read(&sh->q, buf + done, count - done);
+			if (result < 0) {
+				mutex_unlock(&sh->lock);
+				return done ? done : result;
+			}
+			done += result;
+		}
+		mutex_unlock(&sh->lock);
+		if (done < count) /* drained it */
+			dev->rshard = (dev->rshard + 1) % dev->nr_shards;
+	}
+	return done;
+}
+
+/*
+ * The pipe mutex is not held. Returns 0 if the pipe turns out not
+ * to be sharded (any more), for the caller to write the usual way.
+ */
+static ssize_t scull_p_shard_write(struct scull_pipe *dev, struct file *filp,
+		const char __user *buf, size_t count)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_p_shard *shards = smp_load_acquire(&dev->shards);
+	struct scull_p_shard *sh;
+	ssize_t result;
+	int want;
+
+	if (!shards)
+		return 0;
+	sh = &shards[pf->shard % dev->nr_shards];
+	want = min_t(size_t, count, READ_ONCE(dev->wlowat));
+	if (filp->f_flags & O_NONBLOCK || want == 0)
+		want = 1;
+
+	if (mutex_lock_interruptible(&sh->lock))
+		return -ERESTARTSYS;
+	/* the mode only changes while the shards are locked in turn */
+	while (READ_ONCE(dev->mode) == SCULL_P_SHARD &&
+			scull_p_queue_room(&sh->q) < want) {
+		mutex_unlock(&sh->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		/* room in a shard is for its writers only: not exclusive */
+		if (wait_event_interruptible(dev->outq,
+				scull_p_queue_room(&sh->q) >= want ||
+				READ_ONCE(dev->mode) != SCULL_P_SHARD))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&sh->lock))
+			return -ERESTARTSYS;
+	}
+	if (READ_ONCE(dev->mode) != SCULL_P_SHARD) {
+		mutex_unlock(&sh->lock);
+		return 0;
+	}
+	result = scull_p_queue_write(&sh->q, buf, count);
+	mutex_unlock(&sh->lock);
+	if (result <= 0)
+		return result;
+
+	/*
+	 * All writers share inq: don't take its lock, nor look at the
+	 * other shards, unless someone waits. A short reader (see
+	 * scull_p_wake_readers()) wants to hear about any data.
+	 */
+	if (wq_has_sleeper(&dev->inq) && (atomic_read(&dev->rshort) ||
+			scull_p_shards_queued(dev) >= READ_ONCE(dev->rlowat)))
+		scull_p_wake_in(dev);
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	return result;
+}
+
+/*
+ * Elastic mode: once the buffer is full, writes go on into a spill
+ * area made of quantum sets, just like the bare scull device, up to
+ * spill_cap bytes. While anything is spilled, all new data goes there
+ * too, to keep it in order; readers drain the buffer, then the spill
+ * area, freeing quantum sets as they are done with them. These run
+ * with the mutex held.
+ */
+static ssize_t scull_p_spill_write(struct scull_pipe *dev,
+		const char __user *buf, size_t count)
+{
+	loff_t pos = dev->spill.size;
+	ssize_t result;
+
+	/* the cap may have come down under what is spilled already */
+	count = min_t(size_t, count, max(dev->spill_cap - dev->spilled, 0L));
+	result = scull_write_locked(&dev->spill, buf, count, &pos);
+	if (result > 0) {
+		dev->spilled += result;
+		if (dev->spilled > dev->stats.spill_peak)
+			dev->stats.spill_peak = dev->spilled;
+	}
+	return result;
+}
+
+static ssize_t scull_p_spill_read(struct scull_pipe *dev, char __user *buf,
+		size_t count)
+{
+	long itemsize = (long)dev->spill.quantum * dev->spill.qset;
+	ssize_t result;
+
+	result = scull_read_locked(&dev->spill, buf, count, &dev->spill_pos);
+	if (result <= 0)
+		return result;
+	dev->spilled -= result;
+	if (!dev->spilled) {
+		scull_trim(&dev->spill); /* all gone: start over */
+		dev->spill_pos = 0;
+	}
+	while (dev->spill_pos >= itemsize) {
+		scull_shift(&dev->spill);
+		dev->spill_pos -= itemsize;
+	}
+	return result;
+}
+
+/* Ring mode: pick up what user space did to the pointers */
+static void scull_p_ring_load(struct scull_pipe *dev)
+{
+	if (dev->mode != SCULL_P_RING)
+		return;
+	/* acquire: the data before the indexes */
+	dev->wp = dev->buffer + smp_load_acquire(&dev->ring->head) % dev->buffersize;
+	dev->rp = dev->buffer + smp_load_acquire(&dev->ring->tail) % dev->buffersize;
+}
+
+/* The read and write pointers for the lockless checks */
+static char *scull_p_rdptr(struct scull_pipe *dev)
+{
+	if (READ_ONCE(dev->mode) == SCULL_P_RING)
+		return dev->buffer + smp_load_acquire(&dev->ring->tail) % dev->buffersize;
+	return READ_ONCE(dev->rp);
+}
+
+static char *scull_p_wrptr(struct scull_pipe *dev)
+{
+	if (READ_ONCE(dev->mode) == SCULL_P_RING)
+		return dev->buffer + smp_load_acquire(&dev->ring->head) % dev->buffersize;
+	return READ_ONCE(dev->wp);
+}
+
+/*
+ * Wakeups carry the poll bits they are about, so that an epoll entry
+ * added with EPOLLEXCLUSIVE that is only interested in the other
+ * direction isn't counted as the one exclusive waiter we woke.
+ */
+static void scull_p_wake_in(struct scull_pipe *dev)
+{
+	wake_up_interruptible_poll(&dev->inq, POLLIN | POLLRDNORM);
+}
+
+static void scull_p_wake_out(struct scull_pipe *dev)
+{
+	wake_up_interruptible_poll(&dev->outq, POLLOUT | POLLWRNORM);
+}
+
+/*
+ * Broadcast helpers; all of them must be called with the device mutex
+ * held, except scull_p_lag() and scull_p_readable() which are also
+ * used without it to decide whether to sleep or what to tell poll().
+ */
+
+/* How much data is queued ahead of this read pointer? */
+static int scull_p_lag(struct scull_pipe *dev, char *rp)
+{
+	return (scull_p_wrptr(dev) - rp + dev->buffersize) % dev->buffersize;
+}
+
+/* Move dev->rp to the slowest reader; return nonzero if it moved */
+static int scull_p_bcast_tail(struct scull_pipe *dev)
+{
+	struct scull_p_file *pf;
+	char *tail = dev->wp; /* nobody listening: nothing to keep */
+	int lag, maxlag = 0;
+
+	list_for_each_entry(pf, &dev->readers, list) {
+		lag = scull_p_lag(dev, pf->rp);
+		if (lag > maxlag) {
+			maxlag = lag;
+			tail = pf->rp;
+		}
+	}
+	if (tail == dev->rp)
+		return 0;
+	dev->rp = tail;
+	return 1;
+}
+
+/*
+ * The buffer is full and the pipe is set to drop slow readers: skip
+ * the slowest ones forward to the write pointer and flag them.
+ */
+static void scull_p_bcast_drop(struct scull_pipe *dev)
+{
+	struct scull_p_file *pf;
+
+	list_for_each_entry(pf, &dev->readers, list) {
+		if (pf->rp == dev->rp) {
+			pf->rp = dev->wp;
+			pf->overrun = 1;
+		}
+	}
+	scull_p_bcast_tail(dev);
+	scull_p_wake_in(dev); /* let them see the overrun */
+}
+
+/*
+ * Is there enough for this reader? "want" is the low watermark,
+ * but once all writers are gone any leftover data will do, and
+ * priority data never waits for it.
+ */
+static int scull_p_readable(struct scull_pipe *dev, struct scull_p_file *pf,
+		int want)
+{
+	char *rp = READ_ONCE(dev->mode) == SCULL_P_BCAST ?
+			READ_ONCE(pf->rp) : scull_p_rdptr(dev);
+
+	long avail;
+
+	if (READ_ONCE(pf->overrun) || scull_p_lanes_mask(dev))
+		return 1;
+	avail = scull_p_lag(dev, rp) + READ_ONCE(dev->spilled) +
+			scull_p_shards_queued(dev);
+	if (!avail)
+		return 0;
+	return avail >= want || READ_ONCE(dev->nwriters) == 0;
+}
+
+/*
+ * Can a writer go on? In an elastic pipe it can as long as the spill
+ * area is below its cap. Also called without the mutex.
+ */
+static int scull_p_writable(struct scull_pipe *dev, int want)
+{
+	long spilled = READ_ONCE(dev->spilled);
+
+	if (spilled)
+		return spilled < READ_ONCE(dev->spill_cap);
+	return READ_ONCE(dev->spill_cap) || spacefree(dev) >= want;
+}
+
+/* Can this file's writer go on? Its lane or shard may not be the buffer. */
+static int scull_p_can_write(struct scull_pipe *dev, struct scull_p_file *pf,
+		int want)
+{
+	struct scull_p_queue *lanes = smp_load_acquire(&dev->lanes);
+	struct scull_p_shard *shards = smp_load_acquire(&dev->shards);
+	int mode = READ_ONCE(dev->mode);
+
+	if (pf->lane && lanes && mode == SCULL_P_LANES)
+		return scull_p_queue_room(&lanes[pf->lane]) >= want;
+	if (shards && mode == SCULL_P_SHARD)
+		return scull_p_queue_room(&shards[pf->shard % dev->nr_shards].q) >= want;
+	return scull_p_writable(dev, want);
+}
+
+/*
+ * Did a write of "count" bytes give some reader enough to wake up for?
+ * A broadcast reader that was already past the watermark isn't asleep.
+ * Readers asking for less than rlowat wait for just that much, and
+ * while any of them sleeps, any data will do; they check for themselves.
+ */
+static int scull_p_wake_readers(struct scull_pipe *dev, int count)
+{
+	struct scull_p_file *pf;
+	int lag;
+
+	if (count && atomic_read(&dev->rshort))
+		return 1;
+	if (dev->mode != SCULL_P_BCAST)
+		return scull_p_lag(dev, dev->rp) + dev->spilled >= dev->rlowat;
+	list_for_each_entry(pf, &dev->readers, list) {
+		lag = scull_p_lag(dev, pf->rp);
+		if (lag >= dev->rlowat && lag - count < dev->rlowat)
+			return 1;
+	}
+	return 0;
+}
+
+/* The same for the writers, after a read, with wlowat and wshort */
+static int scull_p_wake_writers(struct scull_pipe *dev)
+{
+	if (atomic_read(&dev->wshort))
+		return scull_p_writable(dev, 1);
+	return scull_p_writable(dev, dev->wlowat);
+}
+
+/*
+ * Spin for up to pf->busy_poll microseconds waiting for data, so that
+ * a latency-sensitive reader doesn't pay for a sleep and a wakeup on
+ * every message. Give up early if the CPU is wanted elsewhere or a
+ * signal is pending. Called without the mutex.
+ */
+static int scull_p_spin(struct scull_pipe *dev, struct scull_p_file *pf,
+		int want)
+{
+	u64 end = local_clock() + (u64)pf->busy_poll * NSEC_PER_USEC;
+
+	do {
+		if (scull_p_readable(dev, pf, want))
+			return 1;
+		cpu_relax();
+	} while (local_clock() < end && !need_resched() &&
+			!signal_pending(current));
+	return scull_p_readable(dev, pf, want);
+}
+
 /*
  * Open and close
  */
@@ -66,31 +665,49 @@ static int spacefree(struct scull_pipe *dev);
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
 	struct scull_pipe *dev;
+	struct scull_p_file *pf;
+	int writer;
 
 	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-	filp->private_data = dev;
+	pf = kmalloc(sizeof(struct scull_p_file), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	memset(pf, 0, sizeof(struct scull_p_file));
+	pf->dev = dev;
+	pf->busy_poll = clamp(scull_p_busy_poll, 0, SCULL_P_BUSY_POLL_MAX);
+	INIT_LIST_HEAD(&pf->list);
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (mutex_lock_interruptible(&dev->lock)) {
+		kfree(pf);
 		return -ERESTARTSYS;
-	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
-			mutex_unlock(&dev->lock);
-			return -ENOMEM;
-		}
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
+	/*
+	 * Allocate the buffer. Only a new buffer starts from scratch:
+	 * other openers, broadcast readers above all, may be using this one.
+	 */
+	writer = !!(filp->f_mode & FMODE_WRITE);
+	if ((!dev->buffer && scull_p_alloc(dev, dev->mode, writer)) ||
+	    (dev->mode == SCULL_P_LANES && !dev->lanes && scull_p_alloc_lanes(dev, writer)) ||
+	    (dev->mode == SCULL_P_SHARD && !dev->shards && scull_p_alloc_shards(dev, writer))) {
+		mutex_unlock(&dev->lock);
+		kfree(pf);
+		return -ENOMEM;
+	}
+	scull_p_ring_load(dev);
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
-	if (filp->f_mode & FMODE_READ)
+	if (filp->f_mode & FMODE_READ) {
 		dev->nreaders++;
-	if (filp->f_mode & FMODE_WRITE)
+		pf->rp = dev->wp; /* a new subscriber sees new data only */
+		list_add_tail(&pf->list, &dev->readers);
+	}
+	if (filp->f_mode & FMODE_WRITE) {
 		dev->nwriters++;
+		pf->shard = dev->wshard++;
+	}
 	mutex_unlock(&dev->lock);
 
+	filp->private_data = pf;
 	return nonseekable_open(inode, filp);
 }
 
@@ -98,20 +715,41 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 static int scull_p_release(struct inode *inode, struct file *filp)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	int freed = 0, lastwriter = 0;
 
 	/* remove this filp from the asynchronously notified filp's */
 	scull_p_fasync(-1, filp, 0);
 	mutex_lock(&dev->lock);
-	if (filp->f_mode & FMODE_READ)
+	if (filp->f_mode & FMODE_READ) {
 		dev->nreaders--;
+		list_del(&pf->list);
+		if (dev->mode == SCULL_P_BCAST)
+			freed = scull_p_bcast_tail(dev);
+	}
 	if (filp->f_mode & FMODE_WRITE)
-		dev->nwriters--;
+		lastwriter = --dev->nwriters == 0;
 	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
+		/* no mappings either: they hold a reference to a file */
+		scull_p_free(dev, dev->ring, dev->buffer);
+		dev->ring = NULL;
 		dev->buffer = NULL; /* the other fields are not checked on open */
+		scull_p_free_lanes(dev);
+		scull_p_free_shards(dev);
+		scull_place_reset(&dev->place);
+		scull_trim(&dev->spill);
+		dev->spill_pos = dev->spilled = 0;
 	}
 	mutex_unlock(&dev->lock);
+
+	/* a slow broadcast reader going away may unblock the writer */
+	if (freed)
+		scull_p_wake_out(dev);
+	/* and readers waiting for their watermark get what's left */
+	if (lastwriter)
+		wake_up_interruptible_all(&dev->inq);
+	kfree(pf);
 	return 0;
 }
 
@@ -123,88 +761,252 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	ssize_t result;
+	char **rp;
+	int freed = 1, more = 0, want, err, side, shortfall;
+	int spun = 0, hit = 0, awake = 0;
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 
-	while (dev->rp == dev->wp) { /* nothing to read */
-		mutex_unlock(&dev->lock); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
+	/* like SO_RCVLOWAT: block until min(count, rlowat) bytes are there */
+	want = min_t(size_t, count, dev->rlowat);
+	if (filp->f_flags & O_NONBLOCK)
+		want = 1;
+	while (!scull_p_readable(dev, pf, want)) { /* nothing to read */
+		if (filp->f_flags & O_NONBLOCK) {
+			mutex_unlock(&dev->lock);
 			return -EAGAIN;
-		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		}
+		/* writers only wake us for rlowat bytes, unless told (see wake_readers) */
+		shortfall = want < dev->rlowat;
+		if (shortfall)
+			atomic_inc(&dev->rshort);
+		mutex_unlock(&dev->lock); /* release the lock */
+		/* spin a while first, if asked to; but only once per read */
+		hit = 0; /* back here: whatever spinning found went elsewhere */
+		if (pf->busy_poll && !spun) {
+			spun = 1;
+			hit = awake = scull_p_spin(dev, pf, want);
+		}
+		err = 0;
+		if (!awake) {
+			PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+			/*
+			 * Broadcast readers all want the same data; otherwise
+			 * one write is for one reader, so don't wake the herd.
+			 * A short reader may be woken for less than the others
+			 * want, so it mustn't take the one wakeup from them.
+			 */
+			if (dev->mode == SCULL_P_BCAST || shortfall)
+				err = wait_event_interruptible(dev->inq,
+						scull_p_readable(dev, pf, want));
+			else
+				err = wait_event_interruptible_exclusive(dev->inq,
+						scull_p_readable(dev, pf, want));
+		}
+		if (shortfall)
+			atomic_dec(&dev->rshort);
+		if (err) {
+			/* we may have taken the wakeup meant for another reader */
+			if (scull_p_readable(dev, pf, READ_ONCE(dev->rlowat)))
+				scull_p_wake_in(dev);
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		}
 		/* otherwise loop, but first reacquire the lock */
 		if (mutex_lock_interruptible(&dev->lock))
 			return -ERESTARTSYS;
+		awake = 0; /* someone beat us to it: sleep next time round */
+	}
+	if (spun) {
+		if (hit)
+			dev->stats.busy_poll_hits++;
+		else
+			dev->stats.busy_poll_misses++;
+	}
+	/* broadcast readers read from their own pointer */
+	scull_p_ring_load(dev);
+	rp = dev->mode == SCULL_P_BCAST ? &pf->rp : &dev->rp;
+	if (pf->overrun) {
+		/* report the lost data once, then go on from where we are */
+		pf->overrun = 0;
+		mutex_unlock(&dev->lock);
+		return -EOVERFLOW;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
+
+	/* ok, data is there, return something: the highest lane first */
+	side = scull_p_lanes_mask(dev);
+	if (side || dev->mode == SCULL_P_SHARD) {
+		if (side)
+			result = scull_p_queue_read(&dev->lanes[fls(side) - 1], buf, count);
+		else
+			result = scull_p_shard_read(dev, buf, count);
+		side = 1;
+		if (result < 0) {
+			mutex_unlock (&dev->lock);
+			return result;
+		}
+		count = result;
+		goto done;
+	}
+	if (*rp == dev->wp) {
+		/* the buffer is drained, what's left spilled over */
+		result = scull_p_spill_read(dev, buf, count);
+		if (result < 0) {
+			mutex_unlock (&dev->lock);
+			return result;
+		}
+		count = result;
+		goto done;
+	}
+	if (dev->wp > *rp)
+		count = min(count, (size_t)(dev->wp - *rp));
 	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
+		count = min(count, (size_t)(dev->end - *rp));
+	if (copy_to_user(buf, *rp, count)) {
 		mutex_unlock (&dev->lock);
 		return -EFAULT;
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
+	*rp += count;
+	if (*rp == dev->end)
+		*rp = dev->buffer; /* wrapped */
+	if (dev->mode == SCULL_P_RING) /* release: done with the data */
+		smp_store_release(&dev->ring->tail, dev->rp - dev->buffer);
+	if (dev->mode == SCULL_P_BCAST)
+		freed = scull_p_bcast_tail(dev); /* space only if we were last */
+  done:
+	/*
+	 * Writers only care once there's room for wlowat bytes, or less
+	 * (see wake_writers); those of a lane or a shard check for
+	 * themselves, as they all sleep.
+	 */
+	freed = side || (freed && scull_p_wake_writers(dev));
+	/* we were woken alone: pass on what we left to the next reader */
+	if (dev->mode != SCULL_P_BCAST && dev->nreaders > 1)
+		more = scull_p_readable(dev, pf, dev->rlowat);
 	mutex_unlock (&dev->lock);
 
 	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
+	if (freed)
+		scull_p_wake_out(dev);
+	if (more)
+		scull_p_wake_in(dev);
 	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
 	return count;
 }
 
 /* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+ * error the semaphore will be released before returning. "want" is
+ * how much space we are waiting for (see wlowat). */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+		int want)
 {
-	while (spacefree(dev) == 0) { /* full */
+	struct scull_p_file *pf = filp->private_data;
+	int shortfall;
+
+	while (!scull_p_can_write(dev, pf, want)) { /* full */
 		DEFINE_WAIT(wait);
-		
-		mutex_unlock(&dev->lock);
-		if (filp->f_flags & O_NONBLOCK)
+
+		if (dev->mode == SCULL_P_BCAST && dev->drop) {
+			scull_p_bcast_drop(dev);
+			continue;
+		}
+		if (filp->f_flags & O_NONBLOCK) {
+			mutex_unlock(&dev->lock);
 			return -EAGAIN;
+		}
+		shortfall = want < dev->wlowat; /* see scull_p_wake_writers() */
+		if (shortfall)
+			atomic_inc(&dev->wshort);
+		mutex_unlock(&dev->lock);
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
-		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		/*
+		 * One reader frees room for one writer: sleep exclusively.
+		 * Not with lanes, though, as that room is in one lane only,
+		 * nor when we want less than the other writers.
+		 */
+		if (dev->mode == SCULL_P_LANES || shortfall)
+			prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
+		else
+			prepare_to_wait_exclusive(&dev->outq, &wait, TASK_INTERRUPTIBLE);
+		if (!scull_p_can_write(dev, pf, want))
 			schedule();
 		finish_wait(&dev->outq, &wait);
-		if (signal_pending(current))
+		if (shortfall)
+			atomic_dec(&dev->wshort);
+		if (signal_pending(current)) {
+			/* we may have taken the wakeup meant for another writer */
+			if (scull_p_writable(dev, dev->wlowat))
+				scull_p_wake_out(dev);
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		}
 		if (mutex_lock_interruptible(&dev->lock))
 			return -ERESTARTSYS;
 	}
 	return 0;
 }	
 
-/* How much space is free? */
+/*
+ * How much space is free, up to the high watermark? Also called
+ * without the mutex.
+ */
 static int spacefree(struct scull_pipe *dev)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	char *rp = scull_p_rdptr(dev), *wp = scull_p_wrptr(dev);
+	int queued = (wp - rp + dev->buffersize) % dev->buffersize;
+
+	return max(scull_p_hiwat(dev) - queued, 0);
 }
 
 static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct scull_pipe *dev = filp->private_data;
-	int result;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	int result, want, wake, more = 0, prio = 0;
+	ssize_t written;
 
+  again:
+	if (count && READ_ONCE(dev->mode) == SCULL_P_SHARD) {
+		written = scull_p_shard_write(dev, filp, buf, count);
+		if (written)
+			return written;
+	}
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 
 	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	want = min_t(size_t, count, dev->wlowat);
+	if (filp->f_flags & O_NONBLOCK || want == 0)
+		want = 1;
+	result = scull_getwritespace(dev, filp, want);
 	if (result)
 		return result; /* scull_getwritespace called up(&dev->sem) */
+	if (dev->mode == SCULL_P_SHARD) { /* changed while we slept */
+		mutex_unlock(&dev->lock);
+		goto again;
+	}
 
 	/* ok, space is there, accept something */
+	scull_p_ring_load(dev);
+	if (dev->mode == SCULL_P_LANES && pf->lane) {
+		written = scull_p_queue_write(&dev->lanes[pf->lane], buf, count);
+		prio = 1;
+	} else if (dev->spilled || (dev->spill_cap && spacefree(dev) == 0)) {
+		written = scull_p_spill_write(dev, buf, count);
+	} else {
+		goto buffer;
+	}
+	if (written < 0) {
+		mutex_unlock(&dev->lock);
+		return written;
+	}
+	count = written;
+	goto done;
+
+  buffer:
 	count = min(count, (size_t)spacefree(dev));
 	if (dev->wp >= dev->rp)
 		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
@@ -218,36 +1020,63 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	dev->wp += count;
 	if (dev->wp == dev->end)
 		dev->wp = dev->buffer; /* wrapped */
+	if (dev->mode == SCULL_P_RING) /* release: the data is there */
+		smp_store_release(&dev->ring->head, dev->wp - dev->buffer);
+  done:
+	/* readers don't want to hear about less than rlowat bytes */
+	wake = prio || scull_p_wake_readers(dev, count);
+	/* we were woken alone: pass on the room we left to the next writer */
+	if (dev->nwriters > 1 && dev->mode != SCULL_P_LANES)
+		more = scull_p_writable(dev, dev->wlowat);
 	mutex_unlock(&dev->lock);
 
+	if (more)
+		scull_p_wake_out(dev);
+	if (!wake)
+		goto out;
+
 	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	if (prio)
+		wake_up_interruptible_poll(&dev->inq, POLLIN | POLLRDNORM | POLLPRI);
+	else
+		scull_p_wake_in(dev);  /* blocked in read() and select() */
 
 	/* and signal asynchronous readers, explained late in chapter 5 */
 	if (dev->async_queue)
-		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+		kill_fasync(&dev->async_queue, SIGIO, prio ? POLL_PRI : POLL_IN);
+  out:
 	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
 	return count;
 }
 
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 	unsigned int mask = 0;
 
 	/*
 	 * The buffer is circular; it is considered full
 	 * if "wp" is right behind "rp" and empty if the
 	 * two are equal.
+	 *
+	 * No mutex here: poll is called far more often than read and
+	 * write, and an answer that's stale by the time we return is
+	 * followed by a wakeup anyway, as we are on both queues by then.
+	 * Every write that leaves rlowat bytes queued wakes the queue,
+	 * so EPOLLET users that didn't drain the pipe still get an edge.
 	 */
-	mutex_lock(&dev->lock);
 	poll_wait(filp, &dev->inq,  wait);
 	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	smp_mb(); /* check the pointers after we are on the queues */
+	if (scull_p_readable(dev, pf, READ_ONCE(dev->rlowat)))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (scull_p_lanes_mask(dev))
+		mask |= POLLPRI | POLLRDBAND;	/* priority data */
+	/* a broadcast pipe that drops slow readers never blocks a writer */
+	if ((READ_ONCE(dev->mode) == SCULL_P_BCAST && READ_ONCE(dev->drop)) ||
+	    scull_p_can_write(dev, pf, READ_ONCE(dev->wlowat)))
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	mutex_unlock(&dev->lock);
 	return mask;
 }
 
@@ -257,16 +1086,338 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+
+	return fasync_helper(fd, filp, mode, &pf->dev->async_queue);
+}
+
+
+/*
+ * Change the mode; only while nothing is queued, as the modes don't
+ * agree on what rp means. Going in or out of ring mode means a new
+ * buffer, so it can't be done while the buffer is mapped or while
+ * anyone else has the pipe open and may be looking at the header.
+ * Shard writers don't take the mutex, so on the way out of sharded
+ * mode they are turned away first, then the shards are checked.
+ */
+static int scull_p_set_mode(struct scull_pipe *dev, int mode, int writer)
+{
+	struct scull_p_ring *oldring;
+	struct scull_p_file *reader;
+	char *oldbuffer;
+	int err = 0, oldmode, i;
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	mutex_lock(&dev->map_lock);
+	oldmode = dev->mode;
+	if (oldmode == SCULL_P_SHARD && mode != SCULL_P_SHARD) {
+		/* a plain fifo while we look; they'll wait for the mutex */
+		WRITE_ONCE(dev->mode, SCULL_P_FIFO);
+		for (i = 0; i < dev->nr_shards; i++) {
+			mutex_lock(&dev->shards[i].lock); /* past any writer in there */
+			if (scull_p_queued(&dev->shards[i].q))
+				err = -EBUSY;
+			mutex_unlock(&dev->shards[i].lock);
+		}
+		if (err)
+			goto out;
+	}
+	scull_p_ring_load(dev);
+	if (dev->rp != dev->wp || dev->spilled || scull_p_lanes_mask(dev)) {
+		err = -EBUSY;
+		goto out;
+	}
+	if (mode == SCULL_P_LANES && !dev->lanes) {
+		err = scull_p_alloc_lanes(dev, writer);
+		if (err)
+			goto out;
+	}
+	if (mode == SCULL_P_SHARD && !dev->shards) {
+		err = scull_p_alloc_shards(dev, writer);
+		if (err)
+			goto out;
+	}
+	if ((mode == SCULL_P_RING) != (dev->mode == SCULL_P_RING)) {
+		if (atomic_read(&dev->nmaps) || dev->nreaders + dev->nwriters > 1) {
+			err = -EBUSY;
+			goto out;
+		}
+		oldring = dev->ring;
+		oldbuffer = dev->buffer;
+		err = scull_p_alloc(dev, mode, writer);
+		if (err)
+			goto out;
+		scull_p_free(dev, oldring, oldbuffer);
+	}
+	WRITE_ONCE(dev->mode, mode);
+	if (mode != SCULL_P_FIFO)
+		dev->spill_cap = 0; /* elastic is a kind of fifo */
+	list_for_each_entry(reader, &dev->readers, list) {
+		reader->rp = dev->rp;
+		reader->overrun = 0;
+	}
+  out:
+	if (err)
+		WRITE_ONCE(dev->mode, oldmode);
+	mutex_unlock(&dev->map_lock);
+	mutex_unlock(&dev->lock);
+	return err;
+}
+
+
+/*
+ * The pipe-specific ioctl commands; everything else is handled
+ * by the bare scull ioctl method.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct scull_numa numa;
+	long retval = 0;
+
+	switch(cmd) {
+
+	  case SCULL_P_IOCTMODE:
+		if (arg > SCULL_P_SHARD)
+			return -EINVAL;
+		return scull_p_set_mode(dev, arg, !!(filp->f_mode & FMODE_WRITE));
+
+	  case SCULL_P_IOCQMODE:
+		return dev->mode;
+
+	  case SCULL_P_IOCTDROP:
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		WRITE_ONCE(dev->drop, !!arg); /* poll() looks without the lock */
+		mutex_unlock(&dev->lock);
+		/* writers waiting on a slow reader can go on now */
+		wake_up_interruptible_all(&dev->outq);
+		break;
+
+	  case SCULL_P_IOCQDROP:
+		return READ_ONCE(dev->drop);
+
+	  case SCULL_P_IOCTRLOWAT: /* like SO_RCVLOWAT */
+	  case SCULL_P_IOCTWLOWAT: /* like SO_SNDLOWAT */
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		/*
+		 * 0 means 1, as for sockets; more than the pipe holds can't
+		 * be met, and the two together can't be more than it holds,
+		 * or a reader and a writer could each be waiting for the other.
+		 */
+		arg = clamp_t(unsigned long, arg, 1, max(scull_p_hiwat(dev) -
+				(cmd == SCULL_P_IOCTRLOWAT ? dev->wlowat : dev->rlowat), 1));
+		if (cmd == SCULL_P_IOCTRLOWAT)
+			dev->rlowat = arg;
+		else
+			dev->wlowat = arg;
+		mutex_unlock(&dev->lock);
+		/* a lower mark may be met already */
+		wake_up_interruptible_all(&dev->inq);
+		wake_up_interruptible_all(&dev->outq);
+		break;
+
+	  case SCULL_P_IOCQRLOWAT:
+		return dev->rlowat;
+
+	  case SCULL_P_IOCQWLOWAT:
+		return dev->wlowat;
+
+	  case SCULL_P_IOCTHIWAT: /* writers wait once this much is queued */
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		/* 0 is all that fits; below the low watermarks they'd deadlock */
+		if (arg)
+			arg = clamp_t(unsigned long, arg, dev->rlowat + dev->wlowat,
+					max(dev->buffersize - 1, 1));
+		WRITE_ONCE(dev->hiwat, arg);
+		mutex_unlock(&dev->lock);
+		/* a higher mark may leave room already */
+		wake_up_interruptible_all(&dev->outq);
+		break;
+
+	  case SCULL_P_IOCQHIWAT:
+		return scull_p_hiwat(dev);
+
+	  case SCULL_P_IOCTBUSYPOLL: /* per open file, in usecs */
+		if (arg > SCULL_P_BUSY_POLL_MAX)
+			return -EINVAL;
+		/* spinning burns a CPU: more than the default is for admins */
+		if (arg > READ_ONCE(scull_p_busy_poll) && !capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		pf->busy_poll = arg;
+		break;
+
+	  case SCULL_P_IOCQBUSYPOLL:
+		return pf->busy_poll;
+
+	  case SCULL_P_IOCDOORBELL:
+		/*
+		 * User space moved head or tail of the mapped ring: wake
+		 * whoever can go on now, as our own read and write would.
+		 */
+		if (dev->mode != SCULL_P_RING)
+			return -EINVAL;
+		if (scull_p_readable(dev, pf, atomic_read(&dev->rshort) ? 1 : dev->rlowat)) {
+			scull_p_wake_in(dev);
+			if (dev->async_queue)
+				kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+		}
+		if (scull_p_wake_writers(dev))
+			scull_p_wake_out(dev);
+		break;
+
+	  case SCULL_P_IOCTTAIL:
+		/*
+		 * A consumer that mapped the ring read-only (it opened the
+		 * pipe O_RDONLY, so it doesn't hold off EOF) moves tail here,
+		 * up to head, and the writers waiting for room are woken.
+		 */
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		scull_p_ring_load(dev);
+		if (dev->mode != SCULL_P_RING || arg >= dev->buffersize ||
+				(dev->buffer + arg - dev->rp + dev->buffersize) % dev->buffersize >
+				(dev->wp - dev->rp + dev->buffersize) % dev->buffersize) {
+			mutex_unlock(&dev->lock);
+			return -EINVAL;
+		}
+		dev->rp = dev->buffer + arg;
+		smp_store_release(&dev->ring->tail, arg);
+		mutex_unlock(&dev->lock);
+		if (scull_p_wake_writers(dev))
+			scull_p_wake_out(dev);
+		break;
+
+	  case SCULL_P_IOCTSPILL: /* elastic mode: cap in bytes, 0 is off */
+		if ((long)arg < 0)
+			return -EINVAL;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		if (dev->mode != SCULL_P_FIFO) {
+			mutex_unlock(&dev->lock);
+			return -EINVAL;
+		}
+		WRITE_ONCE(dev->spill_cap, arg); /* also read without the mutex */
+		mutex_unlock(&dev->lock);
+		/* writers waiting for the buffer may spill now */
+		wake_up_interruptible_all(&dev->outq);
+		break;
+
+	  case SCULL_P_IOCQSPILL:
+		return dev->spill_cap;
+
+	  case SCULL_P_IOCTLANE: /* per open file */
+		if (arg >= SCULL_P_NR_LANES)
+			return -EINVAL;
+		pf->lane = arg;
+		break;
+
+	  case SCULL_P_IOCQLANE:
+		return pf->lane;
+
+	  case SCULL_P_IOCQLANES: /* lane 0 is the buffer */
+		return scull_p_lanes_mask(dev) |
+				(scull_p_lag(dev, scull_p_rdptr(dev)) || dev->spilled);
+
+	  case SCULL_P_IOCGSTATS:
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		dev->stats.spill_depth = dev->spilled;
+		if (copy_to_user((void __user *)arg, &dev->stats, sizeof(dev->stats)))
+			retval = -EFAULT;
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCSNUMA: /* for the buffers, and what spills over */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		retval = scull_place_set(&dev->place, &numa);
+		if (!retval)
+			scull_place_set(&dev->spill.place, &numa);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCGNUMA: /* the ring of ring mode isn't counted */
+		memset(&numa, 0, sizeof(numa));
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		scull_place_get(&dev->spill.place, &numa);
+		scull_place_get(&dev->place, &numa);
+		mutex_unlock(&dev->lock);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
+	  default:
+		return scull_ioctl(filp, cmd, arg);
+	}
+	return retval;
+}
+
+
+
+/*
+ * Mapping the ring: the header page, then the data (mapping just
+ * the header is fine, to learn the size from it). Mappings are
+ * counted so that the buffer isn't replaced under them; they can't
+ * outlive the file, so the last release still frees it.
+ */
+static void scull_p_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->nmaps);
+}
+
+static void scull_p_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = vma->vm_private_data;
 
-	return fasync_helper(fd, filp, mode, &dev->async_queue);
+	atomic_dec(&dev->nmaps);
 }
 
+static const struct vm_operations_struct scull_p_vm_ops = {
+	.open =		scull_p_vma_open,
+	.close =	scull_p_vma_close,
+};
+
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	int err = -EINVAL;
+
+	/*
+	 * Not dev->lock: we are called with the mmap lock held, and
+	 * read and write may need that one under dev->lock to fault.
+	 */
+	mutex_lock(&dev->map_lock);
+	if (dev->mode == SCULL_P_RING && vma->vm_pgoff == 0 &&
+			vma->vm_end - vma->vm_start <= PAGE_SIZE + dev->buffersize)
+		err = remap_vmalloc_range(vma, dev->ring, 0);
+	if (!err) {
+		vma->vm_ops = &scull_p_vm_ops;
+		vma->vm_private_data = dev;
+		scull_p_vma_open(vma);
+	}
+	mutex_unlock(&dev->map_lock);
+	return err;
+}
 
 
 /* FIXME this should use seq_file */
 #ifdef SCULL_DEBUG
 
+static const char *scull_p_mode_names[] = { "fifo", "bcast", "ring", "lanes", "shard" };
+
 static int scull_read_p_mem(struct seq_file *s, void *v)
 {
 	int i;
@@ -283,6 +1434,16 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
 		seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
 		seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
 		seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+		seq_printf(s, "   mode %s%s, mapped %i times\n",
+				scull_p_mode_names[p->mode],
+				p->drop ? " (drop)" : "", atomic_read(&p->nmaps));
+		seq_printf(s, "   rlowat %i   wlowat %i   hiwat %i\n", p->rlowat,
+				p->wlowat, scull_p_hiwat(p));
+		seq_printf(s, "   spilled %li of %li (peak %llu)\n", p->spilled,
+				p->spill_cap, (unsigned long long)p->stats.spill_peak);
+		seq_printf(s, "   busy poll: %llu hits %llu misses\n",
+				(unsigned long long)p->stats.busy_poll_hits,
+				(unsigned long long)p->stats.busy_poll_misses);
 		mutex_unlock(&p->lock);
 	}
 	return 0;
@@ -315,7 +1476,8 @@ struct file_operations scull_pipe_fops = {
 	.read =		scull_p_read,
 	.write =	scull_p_write,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl = scull_ioctl,
+	.unlocked_ioctl = scull_p_ioctl,
+	.mmap =		scull_p_mmap,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -329,8 +1491,6 @@ static void scull_p_setup_cdev(struct scull_pipe *dev, int index)
 {
 	int err, devno = scull_p_devno + index;
     
-	cdev_init(&dev->cdev, &scull_pipe_fops);
-	dev->cdev.owner = THIS_MODULE;
 	err = cdev_add (&dev->cdev, devno, 1);
 	/* Fail gracefully if need be */
 	if (err)
@@ -339,6 +1499,59 @@ static void scull_p_setup_cdev(struct scull_pipe *dev, int index)
 
  
 
+/* Initialize and free a pipe, but for its cdev_add and cdev_del */
+static void scull_p_dev_init(struct scull_pipe *dev)
+{
+	init_waitqueue_head(&dev->inq);
+	init_waitqueue_head(&dev->outq);
+	INIT_LIST_HEAD(&dev->readers);
+	dev->rlowat = dev->wlowat = 1;
+	mutex_init(&dev->lock);
+	mutex_init(&dev->map_lock);
+	mutex_init(&dev->spill.lock); /* unused: ours is held */
+	scull_trim(&dev->spill); /* sets its geometry */
+	cdev_init(&dev->cdev, &scull_pipe_fops);
+	dev->cdev.owner = THIS_MODULE;
+}
+
+static void scull_p_dev_free(struct scull_pipe *dev)
+{
+	scull_p_free(dev, dev->ring, dev->buffer);
+	scull_p_free_lanes(dev);
+	scull_p_free_shards(dev);
+	scull_place_reset(&dev->place);
+	scull_trim(&dev->spill);
+}
+
+/*
+ * Pipes made at run time, through scullctl (see ctl.c): "size" is the
+ * buffer size, 0 for the default. The caller adds the cdev, and once
+ * it's gone (when its last file is closed) calls scull_p_delete().
+ */
+struct scull_pipe *scull_p_new(int size)
+{
+	struct scull_pipe *dev;
+
+	dev = kmalloc(sizeof(struct scull_pipe), GFP_KERNEL);
+	if (!dev)
+		return NULL;
+	memset(dev, 0, sizeof(struct scull_pipe));
+	dev->size = size;
+	scull_p_dev_init(dev);
+	return dev;
+}
+
+struct cdev *scull_p_cdev(struct scull_pipe *dev)
+{
+	return &dev->cdev;
+}
+
+void scull_p_delete(struct scull_pipe *dev)
+{
+	scull_p_dev_free(dev);
+	kfree(dev);
+}
+
 /*
  * Initialize the pipe devs; return how many we did.
  */
@@ -359,9 +1572,7 @@ int scull_p_init(dev_t firstdev)
 	}
 	memset(scull_p_devices, 0, scull_p_nr_devs * sizeof(struct scull_pipe));
 	for (i = 0; i < scull_p_nr_devs; i++) {
-		init_waitqueue_head(&(scull_p_devices[i].inq));
-		init_waitqueue_head(&(scull_p_devices[i].outq));
-		mutex_init(&scull_p_devices[i].lock);
+		scull_p_dev_init(scull_p_devices + i);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
@@ -387,7 +1598,7 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		scull_p_dev_free(scull_p_devices + i);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
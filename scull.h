@@ -19,6 +19,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/types.h> /* __u64 and friends, for the ioctl structures */
 
 /*
  * Macros to help debugging
@@ -52,6 +53,10 @@
 #define SCULL_P_NR_DEVS 4  /* scullpipe0 through scullpipe3 */
 #endif
 
+#ifndef SCULL_CTL_MINORS
+#define SCULL_CTL_MINORS 1024 /* scullctl, then the devices it makes */
+#endif
+
 /*
  * The bare device is a variable-length region of memory.
  * Use a linked list of indirect blocks.
@@ -69,6 +74,54 @@
 #define SCULL_QSET    1000
 #endif
 
+/*
+ * No bare device grows past this; the scull_max_size parameter can
+ * change it at load time or later.
+ */
+#ifndef SCULL_MAX_SIZE
+#define SCULL_MAX_SIZE (1LL << 40)	/* 1 TB */
+#endif
+
+/*
+ * In log mode, quanta are allocated this many ahead of the writers.
+ */
+#ifndef SCULL_LOG_AHEAD
+#define SCULL_LOG_AHEAD 16
+#endif
+
+/*
+ * A list item's array of quanta starts with this many entries.
+ */
+#ifndef SCULL_QSET_MIN
+#define SCULL_QSET_MIN 4
+#endif
+
+/*
+ * The largest geometry a user can ask for, per device: a quantum is
+ * one kmalloc, and so is a list item's array of qset pointers.
+ */
+#ifndef SCULL_QUANTUM_MAX
+#define SCULL_QUANTUM_MAX (1 << 20)
+#endif
+#ifndef SCULL_QSET_MAX
+#define SCULL_QSET_MAX (1 << 20)
+#endif
+
+/*
+ * A flight recorder bigger than this takes CAP_SYS_ADMIN.
+ */
+#ifndef SCULL_RING_MAX
+#define SCULL_RING_MAX (64 << 20)
+#endif
+
+/*
+ * Up to this many bytes are kept in a small buffer of their own,
+ * without any quantum set.
+ */
+#ifndef SCULL_SMALL_MAX
+#define SCULL_SMALL_MAX 512
+#endif
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
  */
@@ -76,21 +129,47 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
+#ifdef __KERNEL__ /* user space only needs the ioctl definitions below */
+
 /*
  * Representation of scull quantum sets.
  */
+struct scull_repack;
+struct scull_log;
+
+/*
+ * Where a device's memory goes, see SCULL_IOCSNUMA; main.c allocates
+ * through it and counts the bytes on each node.
+ */
+struct scull_place {
+	int policy, node;	/* as set, SCULL_NUMA_DEFAULT at first */
+	int first;		/* SCULL_NUMA_FIRST: the node + 1, once chosen */
+	int next;		/* SCULL_NUMA_INTERLEAVE: the node used last */
+	atomic_long_t *bytes;	/* nr_node_ids of them, from the first allocation */
+};
+
 struct scull_qset {
 	void **data;
 	struct scull_qset *next;
+	int nr;			/* entries in data, at most the qset */
 };
 
 struct scull_dev {
 	struct scull_qset *data;  /* Pointer to first quantum set */
+	char *small;              /* or small contents, see main.c */
+	int smallroom;            /* the size of that buffer */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
-	unsigned long size;       /* amount of data stored here */
+	loff_t size;              /* amount of data stored here */
+	int pinned;               /* chosen geometry: trim keeps it */
+	struct scull_repack *repack; /* moving to a new geometry */
+	struct scull_log __rcu *log; /* in log mode, see main.c */
+	loff_t ring;              /* in ring mode, what it keeps */
+	struct scull_place place; /* NUMA policy and usage */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
 	struct mutex lock;     /* mutual exclusion semaphore     */
+	wait_queue_head_t inq;    /* readers waiting for more data */
+	struct fasync_struct *async_queue; /* asynchronous readers */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -108,6 +187,9 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern long long scull_max_size;
+extern int scull_numa;
+extern int scull_numa_node;
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -120,16 +202,44 @@ int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
+int     scull_ctl_init(void);
+void    scull_ctl_cleanup(void);
+
+struct scull_pipe;
+struct scull_pipe *scull_p_new(int size);
+struct cdev *scull_p_cdev(struct scull_pipe *dev);
+void    scull_p_delete(struct scull_pipe *dev);
+
+extern struct file_operations scull_fops;
+extern struct file_operations scull_pipe_fops;
+
+struct scull_numa;
+int     scull_place_node(struct scull_place *pl, int writer);
+void   *scull_place_alloc(struct scull_place *pl, size_t size, gfp_t flags,
+                          int node);
+void    scull_place_free(struct scull_place *pl, const void *p);
+void    scull_place_reset(struct scull_place *pl);
+int     scull_place_set(struct scull_place *pl, struct scull_numa *numa);
+void    scull_place_get(struct scull_place *pl, struct scull_numa *numa);
 
 int     scull_trim(struct scull_dev *dev);
+void    scull_open_trim(struct scull_dev *dev);
+void    scull_shift(struct scull_dev *dev);
 
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                     loff_t *f_pos);
+ssize_t scull_read_locked(struct scull_dev *dev, char __user *buf, size_t count,
+                          loff_t *f_pos);
+ssize_t scull_write_locked(struct scull_dev *dev, const char __user *buf,
+                           size_t count, loff_t *f_pos);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+unsigned int scull_poll(struct file *filp, struct poll_table_struct *wait);
+int     scull_fasync(int fd, struct file *filp, int mode);
 
+#endif /* __KERNEL__ */
 
 /*
  * Ioctl definitions
@@ -169,8 +279,330 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Pipe modes. In a broadcast pipe every reader gets the whole stream,
+ * and the writer waits for the slowest reader unless the pipe is set
+ * to drop it; a dropped reader gets EOVERFLOW once and is moved on to
+ * the newest data. A ring pipe can also be mmap()ed, and a lanes
+ * pipe has more than one queue, see below. A sharded pipe has a queue
+ * for each writer (up to one per CPU), which the reader merges: each
+ * writer's data stays in order, but the writers' data is interleaved
+ * in no particular way.
+ */
+#define SCULL_P_FIFO      0
+#define SCULL_P_BCAST     1
+#define SCULL_P_RING      2
+#define SCULL_P_LANES     3
+#define SCULL_P_SHARD     4
+
+#define SCULL_P_IOCTMODE _IO(SCULL_IOC_MAGIC,   15)
+#define SCULL_P_IOCQMODE _IO(SCULL_IOC_MAGIC,   16)
+#define SCULL_P_IOCTDROP _IO(SCULL_IOC_MAGIC,   17)
+#define SCULL_P_IOCQDROP _IO(SCULL_IOC_MAGIC,   18)
+
+/*
+ * Low watermarks, as SO_RCVLOWAT and SO_SNDLOWAT: readers (and poll)
+ * are only woken once this many bytes are queued, writers once this
+ * much space is free. The default of 1 wakes them on every byte.
+ */
+#define SCULL_P_IOCTRLOWAT _IO(SCULL_IOC_MAGIC, 19)
+#define SCULL_P_IOCQRLOWAT _IO(SCULL_IOC_MAGIC, 20)
+#define SCULL_P_IOCTWLOWAT _IO(SCULL_IOC_MAGIC, 21)
+#define SCULL_P_IOCQWLOWAT _IO(SCULL_IOC_MAGIC, 22)
+
+/*
+ * The high watermark: writers wait once this many bytes are queued,
+ * and with SCULL_P_IOCTWLOWAT are woken once it has drained by that
+ * much. 0, the default, is all the buffer holds; it is kept at least
+ * the two low watermarks together.
+ */
+#define SCULL_P_IOCTHIWAT _IO(SCULL_IOC_MAGIC, 49)
+#define SCULL_P_IOCQHIWAT _IO(SCULL_IOC_MAGIC, 50)
+
+/*
+ * Busy polling: a reader that finds the pipe empty spins this many
+ * microseconds before going to sleep. It's a setting of the open file,
+ * the scull_p_busy_poll module parameter gives its initial value; going
+ * above that takes CAP_SYS_ADMIN.
+ */
+#ifndef SCULL_P_BUSY_POLL_MAX
+#define SCULL_P_BUSY_POLL_MAX 100000
+#endif
+
+#define SCULL_P_IOCTBUSYPOLL _IO(SCULL_IOC_MAGIC, 23)
+#define SCULL_P_IOCQBUSYPOLL _IO(SCULL_IOC_MAGIC, 24)
+
+/* Pipe statistics, since the pipe was loaded */
+struct scull_p_stats {
+	__u64 busy_poll_hits;	/* spinning found data */
+	__u64 busy_poll_misses;	/* spun, then slept anyway */
+	__u64 spill_depth;	/* elastic: bytes spilled over right now */
+	__u64 spill_peak;	/* elastic: the most there ever were */
+};
+
+#define SCULL_P_IOCGSTATS _IOR(SCULL_IOC_MAGIC, 25, struct scull_p_stats)
+
+/*
+ * A pipe in ring mode can be mapped: one page with this header, then
+ * "size" bytes of data at offset "data". As for the pipe itself the
+ * ring is empty when head == tail and full when head is right behind
+ * tail. The producer fills from head and then stores the new head,
+ * the consumer reads from tail and then stores the new tail (with
+ * release semantics, in both cases); read() and write() on the pipe
+ * act as one of the two. There's one producer and one consumer. After
+ * moving head or tail, ring the doorbell to wake the other side. A
+ * consumer that opened the pipe read-only can't store tail in its
+ * mapping: it hands the new tail to SCULL_P_IOCTTAIL, which wakes the
+ * writers too.
+ */
+struct scull_p_ring {
+	__u32 head;	/* where the producer writes next */
+	__u32 tail;	/* where the consumer reads next */
+	__u32 size;	/* of the data area, a multiple of the page size */
+	__u32 data;	/* offset of the data area in the mapping */
+};
+
+#define SCULL_P_IOCDOORBELL _IO(SCULL_IOC_MAGIC, 26)
+#define SCULL_P_IOCTTAIL    _IO(SCULL_IOC_MAGIC, 51)
+
+/*
+ * Elastic fifo pipes: when the buffer is full, up to this many bytes
+ * spill over into quantum sets before writers block. 0 turns it off.
+ */
+#define SCULL_P_IOCTSPILL _IO(SCULL_IOC_MAGIC,  27)
+#define SCULL_P_IOCQSPILL _IO(SCULL_IOC_MAGIC,  28)
+
+/*
+ * Priority lanes: a pipe in lanes mode has SCULL_P_NR_LANES queues,
+ * and a read is always served from the highest lane that has data,
+ * lane 0 (the default) being the bulk one. Each open file writes to
+ * the lane it has set. poll() reports POLLPRI while any lane above 0
+ * has data, and QLANES returns a bitmask of the lanes that have some.
+ */
+#ifndef SCULL_P_NR_LANES
+#define SCULL_P_NR_LANES 4
+#endif
+
+#define SCULL_P_IOCTLANE  _IO(SCULL_IOC_MAGIC,  29)
+#define SCULL_P_IOCQLANE  _IO(SCULL_IOC_MAGIC,  30)
+#define SCULL_P_IOCQLANES _IO(SCULL_IOC_MAGIC,  31)
+
+/*
+ * scullwuid: openers from other uids wait in line, and the device
+ * is handed from one uid to the next in the order they came.
+ */
+struct scull_w_stats {
+	__u64 handoffs;		/* times a waiting uid was given the device */
+	__u64 depth;		/* openers waiting right now */
+	__u64 depth_peak;	/* the most that ever waited */
+	__u64 wait_ns;		/* total time the granted openers waited */
+	__u64 wait_ns_max;	/* the longest any of them waited */
+};
+
+#define SCULL_W_IOCGSTATS _IOR(SCULL_IOC_MAGIC, 32, struct scull_w_stats)
+
+/*
+ * The control device, scullctl, makes and removes devices at run time:
+ * CREATE fills in the major and minor of the new device (the minors of
+ * scullctl's own region), DESTROY takes the minor. A destroyed device
+ * goes away for good once the files still open on it are closed. The
+ * geometry has the same limits as SCULL_IOCSGEOMETRY.
+ */
+#define SCULL_CTL_SCULL   0	/* a bare scull device */
+#define SCULL_CTL_PIPE    1	/* a scullpipe */
+
+struct scull_ctl_dev {
+	__u32 type;	/* SCULL_CTL_SCULL or SCULL_CTL_PIPE */
+	__u32 quantum;	/* scull: its geometry, 0 for the default */
+	__u32 qset;
+	__u32 buffer;	/* pipe: its buffer size, 0 for the default */
+	__u32 major;	/* returned */
+	__u32 minor;
+};
+
+#define SCULL_CTL_IOCCREATE  _IOWR(SCULL_IOC_MAGIC, 33, struct scull_ctl_dev)
+#define SCULL_CTL_IOCDESTROY _IO(SCULL_IOC_MAGIC,   34)
+
+/*
+ * Per-device geometry. SET changes this device only, and right away:
+ * if it holds data, that is repacked into the new geometry in the
+ * background (reads go on meanwhile, writes wait for it). A zero
+ * quantum or qset keeps the current one, and more than SCULL_QUANTUM_MAX
+ * or SCULL_QSET_MAX is EINVAL. The device keeps its own geometry when
+ * trimmed. GET also tells whether a repack is going on.
+ */
+struct scull_geometry {
+	__u32 quantum;
+	__u32 qset;
+	__u32 repacking;	/* GET only */
+};
+
+#define SCULL_IOCSGEOMETRY _IOW(SCULL_IOC_MAGIC, 35, struct scull_geometry)
+#define SCULL_IOCGGEOMETRY _IOR(SCULL_IOC_MAGIC, 36, struct scull_geometry)
+
+/*
+ * Log mode, for many writers appending to one device: every write
+ * goes to the end, writers don't wait for each other to copy their
+ * data, and readers only see whole writes. Tell with 1 starts it and
+ * with 0 stops it; Query says whether it's on. A device in log mode
+ * can't change its geometry.
+ */
+#define SCULL_IOCTLOG _IO(SCULL_IOC_MAGIC, 37)
+#define SCULL_IOCQLOG _IO(SCULL_IOC_MAGIC, 38)
+
+/*
+ * Ring mode, a flight recorder: the device keeps the last so many
+ * bytes written (rounded up to whole quanta), allocated up front, and
+ * every write appends over the oldest. Offsets keep counting, and
+ * lseek(SEEK_DATA) finds the oldest byte still there; a reader that
+ * has fallen behind goes on from it. SET empties the device, then
+ * starts ring mode with the size arg points to, or just stops it
+ * with 0; above SCULL_RING_MAX bytes that takes CAP_SYS_ADMIN (EPERM).
+ * Opening write-only doesn't empty a recorder.
+ */
+#define SCULL_IOCSRING _IOW(SCULL_IOC_MAGIC, 39, __u64)
+#define SCULL_IOCGRING _IOR(SCULL_IOC_MAGIC, 40, __u64)
+
+/*
+ * Free memory without emptying the whole device. PUNCH frees the
+ * quanta in a range, which then reads as zeroes, and leaves the size
+ * alone. SSIZE works like ftruncate(): arg points to the new size.
+ * Neither works in log or ring mode. (fallocate() would be the usual
+ * way to punch, but the VFS doesn't pass it on to char devices.)
+ */
+struct scull_range {
+	__u64 offset;
+	__u64 length;
+};
+
+#define SCULL_IOCPUNCH _IOW(SCULL_IOC_MAGIC, 41, struct scull_range)
+#define SCULL_IOCSSIZE _IOW(SCULL_IOC_MAGIC, 42, __u64)
+
+/*
+ * Up to SCULL_BATCH_MAX reads and writes in one go. They are done in
+ * offset order (those at the same offset as submitted), all under one
+ * hold of the device semaphore, and each op's result comes back in it:
+ * the bytes moved, 0 at the end of the device, or -errno. Writes go
+ * where "offset" says, unless the device is a recorder; a device in
+ * log mode refuses the whole batch with EBUSY. A caller being killed
+ * stops it part way, with EINTR.
+ */
+#define SCULL_BATCH_READ  0
+#define SCULL_BATCH_WRITE 1
+#define SCULL_BATCH_MAX   1024
+
+struct scull_batch_op {
+	__u32 op;	/* SCULL_BATCH_READ or _WRITE */
+	__u32 len;
+	__u64 offset;
+	__u64 buf;	/* user pointer */
+	__s64 result;	/* filled in */
+};
+
+struct scull_batch {
+	__u64 ops;	/* user pointer to the array */
+	__u32 count;
+	__u32 pad;
+};
+
+#define SCULL_IOCBATCH _IOW(SCULL_IOC_MAGIC, 43, struct scull_batch)
+
+/*
+ * The extent map of [start, start + length) of a device: the ranges
+ * that have memory behind them (the rest reads as zeroes), neighbouring
+ * quanta merged, and the geometry, to find quantum boundaries with.
+ * "room" says how many extents the array takes, and "mapped" how many
+ * were put in it; with a room of 0 it's just counted. The last extent
+ * of the device is marked SCULL_EXTENT_LAST, as with FIEMAP, even when
+ * the range stops short of it; if that isn't there, the array was too
+ * small or there's more past the range: go again from the end of the
+ * last extent.
+ */
+#define SCULL_EXTENT_LAST 1
+
+struct scull_extent {
+	__u64 offset;
+	__u64 length;
+	__u32 flags;
+	__u32 pad;
+};
+
+struct scull_map {
+	__u64 start;
+	__u64 length;
+	__u32 room;		/* in: extents in the array */
+	__u32 mapped;		/* out: extents found */
+	__u32 quantum;		/* out */
+	__u32 qset;		/* out */
+	__u64 extents;		/* user pointer to the array */
+};
+
+#define SCULL_IOCMAP _IOWR(SCULL_IOC_MAGIC, 44, struct scull_map)
+
+/*
+ * Scans done in the kernel, over the quanta in place, with only the
+ * answer copied out. Ranges are cut to the device, and holes count as
+ * zeroes. SUM gives a checksum of a range: CRC-32C (with seed 0, the
+ * standard one) or xxHash64 with the seed; "length" comes back as the
+ * bytes summed. FIND gives the offset of the first occurrence of a
+ * pattern of up to SCULL_FIND_MAX bytes in a range, or -1.
+ */
+#define SCULL_SUM_CRC32C 0
+#define SCULL_SUM_XXH64  1
+#define SCULL_FIND_MAX   256
+
+struct scull_sum {
+	__u64 offset;
+	__u64 length;
+	__u32 algo;
+	__u32 pad;
+	__u64 seed;
+	__u64 sum;		/* out */
+};
+
+struct scull_find {
+	__u64 offset;
+	__u64 length;
+	__u64 pattern;		/* user pointer */
+	__u32 patlen;
+	__u32 pad;
+	__s64 found;		/* out */
+};
+
+#define SCULL_IOCSUM  _IOWR(SCULL_IOC_MAGIC, 45, struct scull_sum)
+#define SCULL_IOCFIND _IOWR(SCULL_IOC_MAGIC, 46, struct scull_find)
+
+/*
+ * NUMA placement of a device's memory: the quanta and arrays of a bare
+ * device, the buffers of a pipe. DEFAULT follows the scull_numa and
+ * scull_numa_node parameters; LOCAL is the node of whoever allocates;
+ * NODE is always "node"; FIRST is the node of the first writer since
+ * the device was last emptied (a pipe's buffer, allocated at open, is
+ * only placed there if a writer opens it first; on a pipe, setting the
+ * policy needs it open for writing); INTERLEAVE goes round the online
+ * nodes.
+ * A new policy applies to what is allocated from then on. Get also
+ * reports the bytes the device has on each node (the first
+ * SCULL_NUMA_NODES nodes), and for FIRST the node chosen, or -1.
+ */
+#define SCULL_NUMA_DEFAULT	0
+#define SCULL_NUMA_LOCAL	1
+#define SCULL_NUMA_NODE		2
+#define SCULL_NUMA_FIRST	3
+#define SCULL_NUMA_INTERLEAVE	4
+#define SCULL_NUMA_NODES	16
+
+struct scull_numa {
+	__u32 policy;
+	__s32 node;
+	__u64 bytes[SCULL_NUMA_NODES];	/* out */
+};
+
+#define SCULL_IOCSNUMA _IOW(SCULL_IOC_MAGIC, 47, struct scull_numa)
+#define SCULL_IOCGNUMA _IOR(SCULL_IOC_MAGIC, 48, struct scull_numa)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 51
 
 #endif /* _SCULL_H_ */
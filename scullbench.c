@@ -0,0 +1,476 @@
+/* scullbench.c
+ * Rough measurements of the scull devices, to be run before and
+ * after a change to see what it bought. Each test prints one line.
+ *
+ *   scullbench pipe [msgsize] [megabytes] [rlowat] [wlowat] [hiwat]
+ *      one writer and one reader on /dev/scullpipe2; reports
+ *      throughput and context switches per MB on either side
+ *
+ *   scullbench shard [writers] [msgsize] [megabytes]
+ *      that many writers, each with its own file, and one reader on
+ *      /dev/scullpipe2, first as a plain fifo and then sharded;
+ *      without a count, goes through 1, 2, 4, ... 64 writers
+ *
+ *   scullbench pread [size] [megabytes] [count]
+ *      that many small preads, walking through the data on
+ *      /dev/scull3, first with the default 4000 x 1000 geometry
+ *      and then with 4096 x 1024, which needs no divisions
+ *
+ *   scullbench log [writers] [msgsize] [megabytes]
+ *      that many writers appending to /dev/scull3, first with
+ *      O_APPEND alone and then in log mode; without a count, goes
+ *      through 1, 2, 4, ... 64 writers
+ *
+ *   scullbench batch [opsize] [batch] [count] [megabytes]
+ *      that many small reads and writes, half and half, at random
+ *      offsets on /dev/scull3: one pread/pwrite each, then batch ops
+ *      per SCULL_IOCBATCH
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "scull.h"
+
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* context switches of the calling thread so far */
+static long ctxsw(void) {
+   struct rusage ru;
+   getrusage(RUSAGE_THREAD, &ru);
+   return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+
+/*
+ * pipe: one writer thread, one reader thread
+ */
+struct pipe_job {
+   int fd;
+   size_t msgsize, total;
+   long ctxsw;
+};
+
+static void *pipe_writer(void *arg) {
+   struct pipe_job *job = arg;
+   char *buf = calloc(1, job->msgsize);
+   size_t done = 0;
+   ssize_t result;
+   long start = ctxsw();
+
+   while (done < job->total) {
+      result = write(job->fd, buf, job->total - done < job->msgsize ?
+                     job->total - done : job->msgsize);
+      if (result < 0) {
+         perror("pipe: write failed");
+         break;
+      }
+      done += result;
+   }
+   job->ctxsw = ctxsw() - start;
+   close(job->fd); /* lets the reader have what's below rlowat */
+   free(buf);
+   return NULL;
+}
+
+static void *pipe_reader(void *arg) {
+   struct pipe_job *job = arg;
+   char buf[65536];
+   size_t done = 0;
+   ssize_t result;
+   long start = ctxsw();
+
+   while (done < job->total) {
+      result = read(job->fd, buf, sizeof(buf));
+      if (result < 0) {
+         perror("pipe: read failed");
+         break;
+      }
+      done += result;
+   }
+   job->ctxsw = ctxsw() - start;
+   return NULL;
+}
+
+static int bench_pipe(int argc, char **argv) {
+   struct pipe_job wjob, rjob;
+   pthread_t wthread, rthread;
+   size_t msgsize = argc > 0 ? atol(argv[0]) : 64;
+   size_t mb = argc > 1 ? atol(argv[1]) : 64;
+   int rlowat = argc > 2 ? atoi(argv[2]) : 1;
+   int wlowat = argc > 3 ? atoi(argv[3]) : 1;
+   int hiwat = argc > 4 ? atoi(argv[4]) : 0;
+   double t;
+
+   if ((rjob.fd = open("/dev/scullpipe2", O_RDONLY)) == -1 ||
+       (wjob.fd = open("/dev/scullpipe2", O_WRONLY)) == -1) {
+      perror("pipe: open failed");
+      return -1;
+   }
+   if (ioctl(wjob.fd, SCULL_P_IOCTHIWAT, hiwat) < 0 ||
+       ioctl(wjob.fd, SCULL_P_IOCTRLOWAT, rlowat) < 0 ||
+       ioctl(wjob.fd, SCULL_P_IOCTWLOWAT, wlowat) < 0) {
+      perror("pipe: ioctl failed");
+      return -1;
+   }
+   wjob.msgsize = rjob.msgsize = msgsize;
+   wjob.total = rjob.total = mb << 20;
+
+   t = now();
+   pthread_create(&rthread, NULL, pipe_reader, &rjob);
+   pthread_create(&wthread, NULL, pipe_writer, &wjob);
+   pthread_join(wthread, NULL);
+   pthread_join(rthread, NULL);
+   t = now() - t;
+
+   ioctl(rjob.fd, SCULL_P_IOCTRLOWAT, 1);
+   ioctl(rjob.fd, SCULL_P_IOCTWLOWAT, 1);
+   ioctl(rjob.fd, SCULL_P_IOCTHIWAT, 0);
+   close(rjob.fd);
+   printf("pipe: msg %zu rlowat %d wlowat %d hiwat %d: %.1f MB/s, "
+          "ctxsw/MB writer %.1f reader %.1f\n",
+          msgsize, rlowat, wlowat, hiwat, mb / t,
+          (double)wjob.ctxsw / mb, (double)rjob.ctxsw / mb);
+   return 0;
+}
+
+
+/*
+ * shard: many writers, one reader
+ */
+#define MAX_WRITERS 64
+
+/* returns MB/s, or -1 */
+static double shard_run(int mode, int writers, size_t msgsize, size_t mb) {
+   struct pipe_job wjob[MAX_WRITERS], rjob;
+   pthread_t wthread[MAX_WRITERS], rthread;
+   double t;
+   int i;
+
+   if ((rjob.fd = open("/dev/scullpipe2", O_RDONLY)) == -1) {
+      perror("shard: open failed");
+      return -1;
+   }
+   if (ioctl(rjob.fd, SCULL_P_IOCTMODE, mode) < 0) {
+      perror("shard: ioctl failed");
+      close(rjob.fd);
+      return -1;
+   }
+   rjob.msgsize = msgsize;
+   rjob.total = 0;
+   for (i = 0; i < writers; i++) {
+      if ((wjob[i].fd = open("/dev/scullpipe2", O_WRONLY)) == -1) {
+         perror("shard: open failed");
+         return -1;
+      }
+      wjob[i].msgsize = msgsize;
+      wjob[i].total = (mb << 20) / writers;
+      rjob.total += wjob[i].total;
+   }
+
+   t = now();
+   pthread_create(&rthread, NULL, pipe_reader, &rjob);
+   for (i = 0; i < writers; i++)
+      pthread_create(&wthread[i], NULL, pipe_writer, &wjob[i]);
+   for (i = 0; i < writers; i++)
+      pthread_join(wthread[i], NULL);
+   pthread_join(rthread, NULL);
+   t = now() - t;
+
+   ioctl(rjob.fd, SCULL_P_IOCTMODE, SCULL_P_FIFO);
+   close(rjob.fd);
+   return rjob.total / 1048576.0 / t;
+}
+
+static int bench_shard(int argc, char **argv) {
+   int writers = argc > 0 ? atoi(argv[0]) : 0;
+   size_t msgsize = argc > 1 ? atol(argv[1]) : 64;
+   size_t mb = argc > 2 ? atol(argv[2]) : 64;
+   int n = writers ? writers : 1;
+   double fifo, shard;
+
+   if (writers < 0 || writers > MAX_WRITERS) {
+      fprintf(stderr, "shard: 1 to %d writers\n", MAX_WRITERS);
+      return -1;
+   }
+   for (; n <= (writers ? writers : MAX_WRITERS); n *= 2) {
+      fifo = shard_run(SCULL_P_FIFO, n, msgsize, mb);
+      shard = shard_run(SCULL_P_SHARD, n, msgsize, mb);
+      if (fifo < 0 || shard < 0)
+         return -1;
+      printf("shard: %d writers, msg %zu: fifo %.1f MB/s, sharded %.1f MB/s\n",
+             n, msgsize, fifo, shard);
+   }
+   return 0;
+}
+
+
+/*
+ * pread: small reads on a bare device, in two geometries
+ */
+
+/* returns millions of preads per second, or -1 */
+static double pread_run(int quantum, int qset, size_t size, size_t mb,
+                        long count) {
+   struct scull_geometry geom;
+   size_t total = mb << 20, done;
+   char buf[65536];
+   off_t pos = 0;
+   ssize_t got;
+   double t;
+   long i;
+   int fd;
+
+   if ((fd = open("/dev/scull3", O_WRONLY)) == -1) { /* empties it */
+      perror("pread: open failed");
+      return -1;
+   }
+   close(fd);
+   if ((fd = open("/dev/scull3", O_RDWR)) == -1) {
+      perror("pread: open failed");
+      return -1;
+   }
+   memset(&geom, 0, sizeof(geom));
+   geom.quantum = quantum;
+   geom.qset = qset;
+   if (ioctl(fd, SCULL_IOCSGEOMETRY, &geom) < 0) {
+      perror("pread: ioctl failed");
+      close(fd);
+      return -1;
+   }
+   memset(buf, 'x', sizeof(buf));
+   /* a write stops at the end of a quantum */
+   for (done = 0; done < total; done += got)
+      if ((got = pwrite(fd, buf, total - done < sizeof(buf) ?
+                        total - done : sizeof(buf), done)) <= 0) {
+         perror("pread: write failed");
+         close(fd);
+         return -1;
+      }
+
+   t = now();
+   for (i = 0; i < count; i++) {
+      if (pread(fd, buf, size, pos) < 0) {
+         perror("pread: read failed");
+         break;
+      }
+      pos += 4099; /* lands all over the quanta */
+      if (pos + size > total)
+         pos -= total - size;
+   }
+   t = now() - t;
+   close(fd);
+   return count / t / 1e6;
+}
+
+static int bench_pread(int argc, char **argv) {
+   size_t size = argc > 0 ? atol(argv[0]) : 16;
+   size_t mb = argc > 1 ? atol(argv[1]) : 16;
+   long count = argc > 2 ? atol(argv[2]) : 4000000;
+   double plain, pow2;
+   struct scull_geometry geom;
+   int fd;
+
+   if (size == 0 || size > 65536 || mb == 0) {
+      fprintf(stderr, "pread: 1 to 65536 bytes, at least a megabyte\n");
+      return -1;
+   }
+   plain = pread_run(SCULL_QUANTUM, SCULL_QSET, size, mb, count);
+   pow2 = pread_run(4096, 1024, size, mb, count);
+   if ((fd = open("/dev/scull3", O_WRONLY)) != -1) { /* back as it was */
+      geom.quantum = SCULL_QUANTUM;
+      geom.qset = SCULL_QSET;
+      ioctl(fd, SCULL_IOCSGEOMETRY, &geom);
+      close(fd);
+   }
+   if (plain < 0 || pow2 < 0)
+      return -1;
+   printf("pread: %zu bytes: %d x %d %.2f M/s, 4096 x 1024 %.2f M/s\n",
+          size, SCULL_QUANTUM, SCULL_QSET, plain, pow2);
+   return 0;
+}
+
+
+/*
+ * log: many writers appending to one bare device
+ */
+
+/* returns MB/s, or -1 */
+static double log_run(int logmode, int writers, size_t msgsize, size_t mb) {
+   struct pipe_job wjob[MAX_WRITERS];
+   pthread_t wthread[MAX_WRITERS];
+   size_t total = 0;
+   double t;
+   int i, fd;
+
+   if ((fd = open("/dev/scull3", O_WRONLY)) == -1) { /* empties it */
+      perror("log: open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_IOCTLOG, logmode) < 0) {
+      perror("log: ioctl failed");
+      close(fd);
+      return -1;
+   }
+   for (i = 0; i < writers; i++) {
+      if ((wjob[i].fd = open("/dev/scull3", O_WRONLY | O_APPEND)) == -1) {
+         perror("log: open failed");
+         return -1;
+      }
+      wjob[i].msgsize = msgsize;
+      wjob[i].total = (mb << 20) / writers;
+      total += wjob[i].total;
+   }
+
+   t = now();
+   for (i = 0; i < writers; i++)
+      pthread_create(&wthread[i], NULL, pipe_writer, &wjob[i]);
+   for (i = 0; i < writers; i++)
+      pthread_join(wthread[i], NULL);
+   t = now() - t;
+
+   if (lseek(fd, 0, SEEK_END) != total)
+      fprintf(stderr, "log: the device holds %ld bytes, not %zu\n",
+              (long)lseek(fd, 0, SEEK_END), total);
+   ioctl(fd, SCULL_IOCTLOG, 0);
+   close(fd);
+   if ((fd = open("/dev/scull3", O_WRONLY)) != -1)
+      close(fd);
+   return total / 1048576.0 / t;
+}
+
+static int bench_log(int argc, char **argv) {
+   int writers = argc > 0 ? atoi(argv[0]) : 0;
+   size_t msgsize = argc > 1 ? atol(argv[1]) : 64;
+   size_t mb = argc > 2 ? atol(argv[2]) : 64;
+   int n = writers ? writers : 1;
+   double plain, log;
+
+   if (writers < 0 || writers > MAX_WRITERS) {
+      fprintf(stderr, "log: 1 to %d writers\n", MAX_WRITERS);
+      return -1;
+   }
+   for (; n <= (writers ? writers : MAX_WRITERS); n *= 2) {
+      plain = log_run(0, n, msgsize, mb);
+      log = log_run(1, n, msgsize, mb);
+      if (plain < 0 || log < 0)
+         return -1;
+      printf("log: %d writers, msg %zu: O_APPEND %.1f MB/s, log mode %.1f MB/s\n",
+             n, msgsize, plain, log);
+   }
+   return 0;
+}
+
+
+/*
+ * batch: small scattered ops, one syscall each or SCULL_IOCBATCH
+ */
+#define MAX_BATCH SCULL_BATCH_MAX
+
+static int bench_batch(int argc, char **argv) {
+   size_t opsize = argc > 0 ? atol(argv[0]) : 64;
+   int nbatch = argc > 1 ? atoi(argv[1]) : 64;
+   long count = argc > 2 ? atol(argv[2]) : 1000000;
+   size_t mb = argc > 3 ? atol(argv[3]) : 16;
+   static struct scull_batch_op ops[MAX_BATCH];
+   static char bufs[MAX_BATCH][4096];
+   struct scull_batch batch;
+   size_t total = mb << 20, done;
+   double single, batched, t;
+   char fill[65536];
+   ssize_t got;
+   off_t pos;
+   long i;
+   int fd, j;
+
+   if (opsize == 0 || opsize > sizeof(bufs[0]) || nbatch < 1 ||
+       nbatch > MAX_BATCH || total < opsize) {
+      fprintf(stderr, "batch: ops of 1 to %zu bytes, 1 to %d per batch\n",
+              sizeof(bufs[0]), MAX_BATCH);
+      return -1;
+   }
+   if ((fd = open("/dev/scull3", O_WRONLY)) != -1) /* empties it */
+      close(fd);
+   if ((fd = open("/dev/scull3", O_RDWR)) == -1) {
+      perror("batch: open failed");
+      return -1;
+   }
+   memset(fill, 'x', sizeof(fill));
+   for (done = 0; done < total; done += got)
+      if ((got = pwrite(fd, fill, total - done < sizeof(fill) ?
+                        total - done : sizeof(fill), done)) <= 0) {
+         perror("batch: write failed");
+         close(fd);
+         return -1;
+      }
+
+   srandom(1);
+   t = now();
+   for (i = 0; i < count; i++) {
+      pos = random() % (total - opsize);
+      if ((i & 1 ? pwrite(fd, bufs[0], opsize, pos)
+                 : pread(fd, bufs[0], opsize, pos)) < 0) {
+         perror("batch: pread/pwrite failed");
+         break;
+      }
+   }
+   single = count / (now() - t);
+
+   srandom(1);
+   batch.ops = (unsigned long)ops;
+   t = now();
+   for (i = 0; i < count; i += nbatch) {
+      batch.count = count - i < nbatch ? count - i : nbatch;
+      for (j = 0; j < batch.count; j++) {
+         ops[j].op = (i + j) & 1 ? SCULL_BATCH_WRITE : SCULL_BATCH_READ;
+         ops[j].len = opsize;
+         ops[j].offset = random() % (total - opsize);
+         ops[j].buf = (unsigned long)bufs[j];
+      }
+      if (ioctl(fd, SCULL_IOCBATCH, &batch) < 0) {
+         perror("batch: ioctl failed");
+         break;
+      }
+   }
+   batched = count / (now() - t);
+
+   close(fd);
+   if ((fd = open("/dev/scull3", O_WRONLY)) != -1)
+      close(fd);
+   printf("batch: %zu-byte ops: pread/pwrite %.0f ops/s, "
+          "%d per batch %.0f ops/s\n", opsize, single, nbatch, batched);
+   return 0;
+}
+
+
+int main(int argc, char **argv) {
+   if (argc > 1 && !strcmp(argv[1], "pipe"))
+      return bench_pipe(argc - 2, argv + 2);
+   if (argc > 1 && !strcmp(argv[1], "shard"))
+      return bench_shard(argc - 2, argv + 2);
+   if (argc > 1 && !strcmp(argv[1], "pread"))
+      return bench_pread(argc - 2, argv + 2);
+   if (argc > 1 && !strcmp(argv[1], "log"))
+      return bench_log(argc - 2, argv + 2);
+   if (argc > 1 && !strcmp(argv[1], "batch"))
+      return bench_batch(argc - 2, argv + 2);
+
+   fprintf(stderr, "usage: %s pipe [msgsize] [megabytes] [rlowat] [wlowat]\n"
+                   "       %s shard [writers] [msgsize] [megabytes]\n"
+                   "       %s pread [size] [megabytes] [count]\n"
+                   "       %s log [writers] [msgsize] [megabytes]\n"
+                   "       %s batch [opsize] [batch] [count] [megabytes]\n",
+           argv[0], argv[0], argv[0], argv[0], argv[0]);
+   return 1;
+}
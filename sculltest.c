@@ -4,15 +4,51 @@
  * and the 
  * ($Id: sculltest.c,v 1.1 2010/05/19 20:40:00 baker Exp baker $)
  */
+#define _GNU_SOURCE		/* SEEK_DATA */
+#define _FILE_OFFSET_BITS 64
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "scull.h"
+
+static void alarmed(int sig)
+{
+   /* nothing: just interrupt whatever we are blocked in */
+}
 
 int main() {
-   int fd, result, len;
+   int fd, fd2, fd3, result, len;
    char buf[10];
    const char *str;
+   struct scull_p_ring *ring;
+   char *data;
+   size_t maplen;
+   struct scull_ctl_dev ctl;
+   struct scull_geometry geom;
+   ssize_t got;
+   off_t far;
+   __u64 ringsize, newsize;
+   char big[5000], back[5000], dense[3 * SCULL_QUANTUM + 3];
+   struct pollfd pfd;
+   struct scull_range range;
+   struct scull_batch_op ops[2];
+   struct scull_batch batch;
+   struct scull_extent ext[4];
+   struct scull_map map;
+   struct scull_sum sum, sum2;
+   struct scull_find find;
+   struct scull_numa numa;
+   struct sigaction sa;
+   struct scull_p_stats stats, stats2;
+   pid_t pid;
    if ((fd = open("/dev/scull", O_WRONLY)) == -1) {
       perror("1. open failed");
       return -1;
@@ -63,6 +99,663 @@ int main() {
       fprintf (stdout, "passed\n");
    }
    close(fd);
+
+
+   /* a broadcast pipe: both readers get the whole message */
+   str = "bcast"; len = strlen(str);
+   if ((fd = open ("/dev/scullpipe1", O_WRONLY)) == -1) {
+      perror("4. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_BCAST) < 0) {
+      perror("4. ioctl failed");
+      return -1;
+   }
+   if ((fd2 = open ("/dev/scullpipe1", O_RDONLY)) == -1 ||
+       (fd3 = open ("/dev/scullpipe1", O_RDONLY)) == -1) {
+      perror("4. open readers failed");
+      return -1;
+   }
+   if ((result = write (fd, str, len)) != len) {
+      perror("4. write failed");
+      return -1;
+   }
+   if ((result = read (fd2, &buf, sizeof(buf))) != len ||
+       strncmp (buf, str, len)) {
+      fprintf (stdout, "failed: first reader got %d bytes\n", result);
+   } else if ((result = read (fd3, &buf, sizeof(buf))) != len ||
+       strncmp (buf, str, len)) {
+      fprintf (stdout, "failed: second reader got %d bytes\n", result);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_FIFO);
+   close(fd3);
+   close(fd2);
+   close(fd);
+
+
+   /* a mapped ring: write() to it and look, then fill it and read() */
+   str = "ring"; len = strlen(str);
+   if ((fd = open ("/dev/scullpipe3", O_RDWR)) == -1) {
+      perror("5. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_RING) < 0) {
+      perror("5. ioctl failed");
+      return -1;
+   }
+   ring = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+   if (ring == MAP_FAILED) {
+      perror("5. mmap failed");
+      return -1;
+   }
+   maplen = ring->data + ring->size;
+   munmap(ring, getpagesize());
+   ring = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (ring == MAP_FAILED) {
+      perror("5. mmap failed");
+      return -1;
+   }
+   data = (char *)ring + ring->data;
+   if ((result = write (fd, str, len)) != len) {
+      perror("5. write failed");
+      return -1;
+   }
+   if (ring->head - ring->tail != len ||
+       strncmp (data + ring->tail, str, len)) {
+      fprintf (stdout, "failed: ring has head %u tail %u\n",
+               ring->head, ring->tail);
+   } else {
+      ioctl(fd, SCULL_P_IOCTTAIL, ring->head); /* as a read-only consumer */
+      memcpy(data + ring->head, str, len);
+      __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+      ioctl(fd, SCULL_P_IOCDOORBELL);
+      if ((result = read (fd, &buf, sizeof(buf))) != len ||
+          strncmp (buf, str, len)) {
+         fprintf (stdout, "failed: read back %d bytes from the ring\n", result);
+      } else {
+         fprintf (stdout, "passed\n");
+      }
+   }
+   munmap(ring, maplen);
+   ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_FIFO);
+   close(fd);
+
+
+   /* lanes: a message on lane 2 overtakes the bulk data on lane 0 */
+   if ((fd = open ("/dev/scullpipe3", O_RDWR)) == -1 ||
+       (fd2 = open ("/dev/scullpipe3", O_WRONLY)) == -1) {
+      perror("6. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_LANES) < 0 ||
+       ioctl(fd2, SCULL_P_IOCTLANE, 2) < 0) {
+      perror("6. ioctl failed");
+      return -1;
+   }
+   if (write (fd, "bulk", 4) != 4 || write (fd2, "beat", 4) != 4) {
+      perror("6. write failed");
+      return -1;
+   }
+   if ((result = ioctl(fd, SCULL_P_IOCQLANES)) != 5 ||
+       read (fd, &buf, sizeof(buf)) != 4 || strncmp (buf, "beat", 4)) {
+      fprintf (stdout, "failed: lanes %#x, read %.4s\n", result, buf);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   read (fd, &buf, sizeof(buf));
+   ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_FIFO);
+   close(fd2);
+   close(fd);
+
+
+   /* sharded: one read merges what two writers left in their shards */
+   if ((fd = open ("/dev/scullpipe3", O_RDONLY)) == -1 ||
+       (fd2 = open ("/dev/scullpipe3", O_WRONLY)) == -1 ||
+       (fd3 = open ("/dev/scullpipe3", O_WRONLY)) == -1) {
+      perror("7. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_SHARD) < 0) {
+      perror("7. ioctl failed");
+      return -1;
+   }
+   if (write (fd2, "ab", 2) != 2 || write (fd3, "cd", 2) != 2) {
+      perror("7. write failed");
+      return -1;
+   }
+   if ((result = read (fd, &buf, sizeof(buf))) != 4 ||
+       (strncmp (buf, "abcd", 4) && strncmp (buf, "cdab", 4))) {
+      fprintf (stdout, "failed: read %d bytes from the shards\n", result);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   ioctl(fd, SCULL_P_IOCTMODE, SCULL_P_FIFO);
+   close(fd3);
+   close(fd2);
+   close(fd);
+
+
+   /* scullctl: make a pipe with a buffer of its own, then remove it */
+   if ((fd = open ("/dev/scullctl", O_RDWR)) == -1) {
+      perror("8. open failed");
+      return -1;
+   }
+   memset(&ctl, 0, sizeof(ctl));
+   ctl.type = SCULL_CTL_PIPE;
+   ctl.buffer = 100;
+   if (ioctl(fd, SCULL_CTL_IOCCREATE, &ctl) < 0) {
+      perror("8. ioctl failed");
+      return -1;
+   }
+   if (ctl.minor == 0 || ioctl(fd, SCULL_CTL_IOCDESTROY, ctl.minor) < 0 ||
+       ioctl(fd, SCULL_CTL_IOCDESTROY, ctl.minor) != -1) {
+      fprintf (stdout, "failed: minor %u\n", ctl.minor);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+
+
+   /* repack what scull1 holds into 3-byte quanta, and read it back */
+   str = "abcdefg"; len = strlen(str);
+   if ((fd = open ("/dev/scull1", O_RDWR)) == -1) {
+      perror("9. open failed");
+      return -1;
+   }
+   if (write (fd, str, len) != len) {
+      perror("9. write failed");
+      return -1;
+   }
+   geom.quantum = 3;
+   geom.qset = 2;
+   if (ioctl(fd, SCULL_IOCSGEOMETRY, &geom) < 0) {
+      perror("9. ioctl failed");
+      return -1;
+   }
+   do {
+      ioctl(fd, SCULL_IOCGGEOMETRY, &geom);
+   } while (geom.repacking);
+   lseek(fd, 0, SEEK_SET);
+   for (result = 0; result < len; result += got) /* a quantum at a time */
+      if ((got = read (fd, buf + result, sizeof(buf) - result)) <= 0)
+         break;
+   if (geom.quantum != 3 || result < len || strncmp (buf, str, len)) {
+      fprintf (stdout, "failed: quantum %u, read %.7s\n", geom.quantum, buf);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   geom.quantum = SCULL_QUANTUM;
+   geom.qset = SCULL_QSET;
+   ioctl(fd, SCULL_IOCSGEOMETRY, &geom);
+   close(fd);
+
+
+   /* write and read back past 4 GB on scull2, then past the limit */
+   str = "abcde"; len = strlen(str);
+   far = 5LL << 30;
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1) {
+      perror("10. open failed");
+      return -1;
+   }
+   if (pwrite (fd, str, len, far) != len) {
+      perror("10. write failed");
+      return -1;
+   }
+   memset (buf, 0, sizeof(buf));
+   result = pread (fd, buf, len, far);
+   if (result != len || strncmp (buf, str, len) ||
+       lseek (fd, 0, SEEK_END) != far + len) {
+      fprintf (stdout, "failed: read %d bytes at 5 GB\n", result);
+   } else if (pwrite (fd, str, len, SCULL_MAX_SIZE) != -1 || errno != EFBIG) {
+      fprintf (stdout, "failed: wrote past the maximum size\n");
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1) /* trims it */
+      close(fd);
+
+
+   /* two appenders on scull3 in log mode; it reads back as one log */
+   if ((fd = open ("/dev/scull3", O_RDWR)) == -1 ||
+       (fd2 = open ("/dev/scull3", O_WRONLY | O_APPEND)) == -1 ||
+       (fd3 = open ("/dev/scull3", O_WRONLY | O_APPEND)) == -1) {
+      perror("11. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_IOCTLOG, 1) < 0) {
+      perror("11. ioctl failed");
+      return -1;
+   }
+   if (write (fd2, "abc", 3) != 3 || pwrite (fd3, "de", 2, 0) != 2) {
+      perror("11. write failed");
+      return -1;
+   }
+   memset (buf, 0, sizeof(buf));
+   result = pread (fd, buf, sizeof(buf), 0);
+   if (ioctl(fd, SCULL_IOCQLOG) != 1 || result != 5 ||
+       strncmp (buf, "abcde", 5)) {
+      fprintf (stdout, "failed: read %d bytes, %.5s\n", result, buf);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   ioctl(fd, SCULL_IOCTLOG, 0);
+   close(fd3);
+   close(fd2);
+   close(fd);
+   if ((fd = open ("/dev/scull3", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* a one-quantum recorder on scull1: write 5000 bytes, 4000 are left */
+   if ((fd = open ("/dev/scull1", O_RDWR)) == -1) {
+      perror("12. open failed");
+      return -1;
+   }
+   ringsize = SCULL_QUANTUM;
+   if (ioctl(fd, SCULL_IOCSRING, &ringsize) < 0) {
+      perror("12. ioctl failed");
+      return -1;
+   }
+   for (len = 0; len < sizeof(big); len++)
+      big[len] = 'a' + len % 26;
+   for (len = 0; len < sizeof(big); len += got)
+      if ((got = write (fd, big + len, sizeof(big) - len)) <= 0) {
+         perror("12. write failed");
+         return -1;
+      }
+   far = lseek (fd, 0, SEEK_DATA);
+   memset (buf, 0, sizeof(buf));
+   result = read (fd, buf, 5);
+   if (far != sizeof(big) - SCULL_QUANTUM || result != 5 ||
+       strncmp (buf, big + far, 5)) {
+      fprintf (stdout, "failed: oldest byte at %ld, read %.5s\n",
+               (long)far, buf);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   ringsize = 0;
+   ioctl(fd, SCULL_IOCSRING, &ringsize);
+   close(fd);
+
+
+   /* a reader at the end of the empty scull2 polls readable once it grows */
+   if ((fd = open ("/dev/scull2", O_RDONLY)) == -1 ||
+       (fd2 = open ("/dev/scull2", O_WRONLY | O_APPEND)) == -1) {
+      perror("13. open failed");
+      return -1;
+   }
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   result = poll (&pfd, 1, 0);
+   if (write (fd2, "a", 1) != 1) {
+      perror("13. write failed");
+      return -1;
+   }
+   if (result != 0 || poll (&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)) {
+      fprintf (stdout, "failed: poll before the write said %d\n", result);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd2);
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* punch out scull2's first quantum, then cut it down to 4002 bytes */
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1) {
+      perror("14. open failed");
+      return -1;
+   }
+   for (len = 0; len < sizeof(big); len += got)
+      if ((got = write (fd, big + len, sizeof(big) - len)) <= 0) {
+         perror("14. write failed");
+         return -1;
+      }
+   range.offset = 0;
+   range.length = SCULL_QUANTUM;
+   newsize = SCULL_QUANTUM + 2;
+   if (ioctl(fd, SCULL_IOCPUNCH, &range) < 0 ||
+       ioctl(fd, SCULL_IOCSSIZE, &newsize) < 0) {
+      perror("14. ioctl failed");
+      return -1;
+   }
+   memset (buf, 1, sizeof(buf));
+   result = pread (fd, buf, 2, 0);
+   len = pread (fd, buf + 2, sizeof(buf) - 2, SCULL_QUANTUM);
+   if (result != 2 || buf[0] || buf[1] || len != 2 ||
+       strncmp (buf + 2, big + SCULL_QUANTUM, 2) ||
+       lseek (fd, 0, SEEK_HOLE) != 0 ||
+       lseek (fd, 0, SEEK_DATA) != SCULL_QUANTUM ||
+       lseek (fd, 0, SEEK_END) != SCULL_QUANTUM + 2) {
+      fprintf (stdout, "failed: read %d and %d bytes\n", result, len);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* a batch that writes at 10 on scull2, then reads it back */
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1) {
+      perror("15. open failed");
+      return -1;
+   }
+   memset (buf, 0, sizeof(buf));
+   memset (ops, 0, sizeof(ops));
+   ops[0].op = SCULL_BATCH_WRITE;
+   ops[0].len = 3;
+   ops[0].offset = 10;
+   ops[0].buf = (unsigned long)"xyz";
+   ops[1].op = SCULL_BATCH_READ;
+   ops[1].len = sizeof(buf);
+   ops[1].offset = 10;
+   ops[1].buf = (unsigned long)buf;
+   batch.ops = (unsigned long)ops;
+   batch.count = 2;
+   if (ioctl(fd, SCULL_IOCBATCH, &batch) < 0) {
+      perror("15. ioctl failed");
+      return -1;
+   }
+   if (ops[0].result != 3 || ops[1].result != 3 || strncmp (buf, "xyz", 3)) {
+      fprintf (stdout, "failed: results %lld and %lld\n",
+               (long long)ops[0].result, (long long)ops[1].result);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* bytes in scull2's first and fourth quanta make two extents */
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1) {
+      perror("16. open failed");
+      return -1;
+   }
+   if (pwrite (fd, "a", 1, 0) != 1 ||
+       pwrite (fd, "b", 1, 3 * SCULL_QUANTUM) != 1) {
+      perror("16. write failed");
+      return -1;
+   }
+   memset (&map, 0, sizeof(map));
+   map.length = ~0ULL;
+   map.room = 4;
+   map.extents = (unsigned long)ext;
+   if (ioctl(fd, SCULL_IOCMAP, &map) < 0) {
+      perror("16. ioctl failed");
+      return -1;
+   }
+   if (map.mapped != 2 || ext[0].offset != 0 ||
+       ext[0].length != SCULL_QUANTUM || ext[1].offset != 3 * SCULL_QUANTUM ||
+       ext[1].length != 1 || !(ext[1].flags & SCULL_EXTENT_LAST)) {
+      fprintf (stdout, "failed: %u extents\n", map.mapped);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* the CRC-32C check value, and a search, done in the kernel */
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1) {
+      perror("17. open failed");
+      return -1;
+   }
+   if (write (fd, "123456789", 9) != 9) {
+      perror("17. write failed");
+      return -1;
+   }
+   memset (&sum, 0, sizeof(sum));
+   sum.length = ~0ULL;
+   sum.algo = SCULL_SUM_CRC32C;
+   memset (&find, 0, sizeof(find));
+   find.length = ~0ULL;
+   find.pattern = (unsigned long)"567";
+   find.patlen = 3;
+   if (ioctl(fd, SCULL_IOCSUM, &sum) < 0 || ioctl(fd, SCULL_IOCFIND, &find) < 0) {
+      perror("17. ioctl failed");
+      return -1;
+   }
+   if (sum.sum != 0xe3069283 || sum.length != 9 || find.found != 4) {
+      fprintf (stdout, "failed: crc %#llx, found at %lld\n",
+               (unsigned long long)sum.sum, (long long)find.found);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* quanta placed on node 0, and counted there */
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1) {
+      perror("18. open failed");
+      return -1;
+   }
+   memset (&numa, 0, sizeof(numa));
+   numa.policy = SCULL_NUMA_NODE;
+   numa.node = 0;
+   if (ioctl(fd, SCULL_IOCSNUMA, &numa) < 0) {
+      perror("18. ioctl failed");
+      return -1;
+   }
+   if (write (fd, big, SCULL_QUANTUM) != SCULL_QUANTUM) { /* one quantum */
+      perror("18. write failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_IOCGNUMA, &numa) < 0) {
+      perror("18. ioctl failed");
+      return -1;
+   }
+   if (numa.policy != SCULL_NUMA_NODE || numa.bytes[0] < SCULL_QUANTUM) {
+      fprintf (stdout, "failed: policy %u, %llu bytes on node 0\n",
+               numa.policy, (unsigned long long)numa.bytes[0]);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   numa.policy = SCULL_NUMA_DEFAULT;
+   ioctl(fd, SCULL_IOCSNUMA, &numa);
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* a read asking for less than rlowat wakes up for that much */
+   if ((fd = open ("/dev/scullpipe2", O_RDONLY)) == -1 ||
+       (fd2 = open ("/dev/scullpipe2", O_WRONLY)) == -1) {
+      perror("19. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTRLOWAT, 1000) < 0) {
+      perror("19. ioctl failed");
+      return -1;
+   }
+   if ((pid = fork()) == 0) {
+      sleep(1);
+      write (fd2, big, 700);
+      sleep(3); /* still a writer, so the leftovers rule doesn't apply */
+      _exit(0);
+   }
+   close(fd2);
+   memset (&sa, 0, sizeof(sa));
+   sa.sa_handler = alarmed; /* no SA_RESTART: read() fails with EINTR */
+   sigaction(SIGALRM, &sa, NULL);
+   alarm(2);
+   result = read (fd, big, 500);
+   alarm(0);
+   if (result != 500) {
+      fprintf (stdout, "failed: read returned %d\n", result);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   waitpid(pid, NULL, 0);
+   ioctl(fd, SCULL_P_IOCTRLOWAT, 1);
+   close(fd);
+
+
+   /* busy polling: a read that spun is counted once, hit or miss */
+   if ((fd = open ("/dev/scullpipe2", O_RDONLY)) == -1 ||
+       (fd2 = open ("/dev/scullpipe2", O_WRONLY)) == -1) {
+      perror("20. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTBUSYPOLL, 50000) < 0 ||
+       ioctl(fd, SCULL_P_IOCGSTATS, &stats) < 0) {
+      perror("20. ioctl failed");
+      return -1;
+   }
+   if ((pid = fork()) == 0) {
+      usleep(10000); /* within the spin, on an idle machine */
+      write (fd2, "spin", 4);
+      _exit(0);
+   }
+   close(fd2);
+   result = read (fd, &buf, sizeof(buf));
+   waitpid(pid, NULL, 0);
+   if (ioctl(fd, SCULL_P_IOCGSTATS, &stats2) < 0) {
+      perror("20. ioctl failed");
+      return -1;
+   }
+   if (result != 4 || stats2.busy_poll_hits + stats2.busy_poll_misses !=
+       stats.busy_poll_hits + stats.busy_poll_misses + 1) {
+      fprintf (stdout, "failed: read %d bytes, %llu hits, %llu misses\n", result,
+               (unsigned long long)(stats2.busy_poll_hits - stats.busy_poll_hits),
+               (unsigned long long)(stats2.busy_poll_misses - stats.busy_poll_misses));
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+
+
+   /* elastic: what doesn't fit in the buffer spills over, in order */
+   if ((fd = open ("/dev/scullpipe2", O_RDWR | O_NONBLOCK)) == -1) {
+      perror("21. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTSPILL, 10000) < 0) {
+      perror("21. ioctl failed");
+      return -1;
+   }
+   for (len = 0; len < sizeof(big); len++)
+      big[len] = 'a' + len % 26;
+   for (len = 0; len < sizeof(big); len += got)
+      if ((got = write (fd, big + len, sizeof(big) - len)) <= 0) {
+         perror("21. write failed");
+         return -1;
+      }
+   for (len = 0; len < sizeof(back); len += got)
+      if ((got = read (fd, back + len, sizeof(back) - len)) <= 0)
+         break;
+   if (len != sizeof(back) || memcmp (big, back, sizeof(back))) {
+      fprintf (stdout, "failed: read back %d bytes\n", len);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   ioctl(fd, SCULL_P_IOCTSPILL, 0);
+   close(fd);
+
+
+   /* past two quanta of hole, a match across a quantum boundary; the
+      sum is that of the same bytes written out in full on scull3 */
+   if ((fd = open ("/dev/scull3", O_WRONLY)) != -1)
+      close(fd);
+   if ((fd = open ("/dev/scull2", O_RDWR)) == -1 ||
+       (fd2 = open ("/dev/scull3", O_RDWR)) == -1) {
+      perror("22. open failed");
+      return -1;
+   }
+   memset (dense, 0, sizeof(dense));
+   memcpy (dense + 3 * SCULL_QUANTUM - 3, "needle", 6);
+   for (len = 0; len < 6; len += got)
+      if ((got = pwrite (fd, "needle" + len, 6 - len,
+                         3 * SCULL_QUANTUM - 3 + len)) <= 0) {
+         perror("22. write failed");
+         return -1;
+      }
+   for (len = 0; len < sizeof(dense); len += got)
+      if ((got = write (fd2, dense + len, sizeof(dense) - len)) <= 0) {
+         perror("22. write failed");
+         return -1;
+      }
+   memset (&sum, 0, sizeof(sum));
+   sum.length = ~0ULL;
+   sum.algo = SCULL_SUM_CRC32C;
+   sum2 = sum;
+   memset (&find, 0, sizeof(find));
+   find.length = ~0ULL;
+   find.pattern = (unsigned long)"needle";
+   find.patlen = 6;
+   if (ioctl(fd, SCULL_IOCSUM, &sum) < 0 || ioctl(fd2, SCULL_IOCSUM, &sum2) < 0 ||
+       ioctl(fd, SCULL_IOCFIND, &find) < 0) {
+      perror("22. ioctl failed");
+      return -1;
+   }
+   if (find.found != 3 * SCULL_QUANTUM - 3 || sum.sum != sum2.sum ||
+       sum.length != sizeof(dense) || sum2.length != sizeof(dense) ||
+       lseek (fd, 0, SEEK_DATA) != 2 * SCULL_QUANTUM) {
+      fprintf (stdout, "failed: found at %lld, crc %#llx against %#llx\n",
+               (long long)find.found, (unsigned long long)sum.sum,
+               (unsigned long long)sum2.sum);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd2);
+   close(fd);
+   if ((fd = open ("/dev/scull2", O_WRONLY)) != -1)
+      close(fd);
+   if ((fd = open ("/dev/scull3", O_WRONLY)) != -1)
+      close(fd);
+
+
+   /* a writer stops at the high watermark, short of the buffer size */
+   if ((fd = open ("/dev/scullpipe2", O_RDWR | O_NONBLOCK)) == -1) {
+      perror("23. open failed");
+      return -1;
+   }
+   if (ioctl(fd, SCULL_P_IOCTHIWAT, 100) < 0) {
+      perror("23. ioctl failed");
+      return -1;
+   }
+   result = write (fd, big, sizeof(big));
+   len = read (fd, back, sizeof(back));
+   if (result != 100 || len != 100 || ioctl(fd, SCULL_P_IOCQHIWAT) != 100) {
+      fprintf (stdout, "failed: wrote %d bytes, read %d\n", result, len);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   ioctl(fd, SCULL_P_IOCTHIWAT, 0);
+   close(fd);
+
+
+   /* a scullpriv clone keeps its data after the last close, by default */
+   if ((fd = open ("/dev/scullpriv", O_WRONLY)) == -1 && errno == EINVAL) {
+      fprintf (stdout, "skipped: no controlling tty\n");
+      return 0;
+   }
+   if (fd == -1 || write (fd, "kept", 4) != 4) {
+      perror("24. write failed");
+      return -1;
+   }
+   close(fd);
+   if ((fd = open ("/dev/scullpriv", O_RDONLY)) == -1) {
+      perror("24. open failed");
+      return -1;
+   }
+   memset (buf, 0, sizeof(buf));
+   if ((result = read (fd, buf, sizeof(buf))) != 4 || strncmp (buf, "kept", 4)) {
+      fprintf (stdout, "failed: read back %d bytes\n", result);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   close(fd);
+   if ((fd = open ("/dev/scullpriv", O_WRONLY)) != -1)
+      close(fd);
    return 0;
    
 }
\ No newline at end of file